@@ -0,0 +1,425 @@
+/*--!>
+This file is part of 'rstr', a simple random string generator written in C++.
+
+Copyright 2016 outshined (outshined@riseup.net)
+    (PGP: 0x8A80C12396A4836F82A93FA79CA3D0F7E8FBCED6)
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, either version 3 of the
+License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+--------------------------------------------------------------------------<!--*/
+#include "bench.h"
+#include "worker.h"
+
+#include <nebula/foundation/scope_exit.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <type_traits>
+
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace {
+
+//------------------------------------------------------------------------------
+/** What one case of --bench measured.
+ */
+struct bench_result
+{
+    uint64_t strings = 0;
+    uint64_t bytes = 0;
+    double seconds = 0;
+    fnd::vector<uint64_t> latencies; // nanoseconds per batch, sorted
+};
+//------------------------------------------------------------------------------
+/** Runs a worker like record_worker or raw_worker on each of @p nthreads
+ * threads for about @p duration, generating @p batch units at a time into a
+ * chunk_buffer. If @p fd is negative the chunks are thrown away, so nothing
+ * but the generation is measured. Otherwise every thread writes them
+ * through an output_buffer of its own to @p fd, like run_parallel() does.
+ *
+ * Every thread gets its own device, which isn't part of the measurement.
+ * Must be called within with_random_mode().
+ */
+template <class MakeWork>
+inline bench_result bench_case(
+    const random_mode rndmode,
+    const unsigned nthreads,
+    const uint64_t batch,
+    const uint64_t strings_per_batch,
+    const chrono::nanoseconds duration,
+    const int fd,
+    const unsigned queue_depth,
+    MakeWork &&make_work)
+{
+    using clock = chrono::steady_clock;
+    
+    struct thread_result
+    {
+        fnd::vector<uint64_t> latencies;
+        uint64_t bytes = 0;
+        fnd::exception_ptr error;
+    };
+    
+    std::atomic<unsigned> ready(0);
+    std::atomic<bool> go(false);
+    clock::time_point deadline;
+    
+    fnd::vector<thread_result> results(nthreads);
+    auto run = [&] (const unsigned w) {
+        thread_result &res = results[w];
+        try {
+            with_device(rndmode, [&] (auto &rnd) {
+                auto work = make_work(rnd);
+                chunk_buffer buf;
+                std::unique_ptr<output_buffer> out;
+                if(fd >= 0)
+                    out.reset(new output_buffer(
+                        fd, output_buffer::default_capacity, queue_depth));
+                ++ready;
+                while(!go)
+                    std::this_thread::yield();
+                
+                while(true)
+                {
+                    const clock::time_point t0 = clock::now();
+                    buf.clear();
+                    work(0, batch, buf);
+                    if(out)
+                        out->write(buf.data(), buf.size());
+                    const clock::time_point t1 = clock::now();
+                    res.latencies.push_back(uint64_t(
+                        chrono::duration_cast<chrono::nanoseconds>(
+                            t1 - t0).count()));
+                    res.bytes += buf.size();
+                    if(t1 >= deadline)
+                        break;
+                }
+                if(out)
+                    out->flush();
+            });
+        }
+        catch(...) {
+            res.error = fnd::current_exception();
+            ++ready;
+        }
+    };
+    
+    fnd::vector<std::thread> threads;
+    for(unsigned w = 0; w < nthreads; ++w)
+        threads.emplace_back(run, w);
+    while(ready < nthreads)
+        std::this_thread::yield();
+    const clock::time_point start = clock::now();
+    deadline = start + duration;
+    go = true;
+    for(auto &t : threads)
+        t.join();
+    
+    bench_result r;
+    r.seconds = chrono::duration_cast<chrono::duration<double>>(
+        clock::now() - start).count();
+    for(auto &res : results)
+    {
+        if(res.error)
+            std::rethrow_exception(res.error);
+        r.strings += res.latencies.size() * strings_per_batch;
+        r.bytes += res.bytes;
+        r.latencies.insert(r.latencies.end(),
+            res.latencies.begin(), res.latencies.end());
+    }
+    std::sort(r.latencies.begin(), r.latencies.end());
+    return r;
+}
+//------------------------------------------------------------------------------
+/** Runs this program with @p args, output going to /dev/null, for about
+ * @p duration but at least 10 times.
+ * @return The times from exec to exit in nanoseconds, sorted.
+ */
+inline fnd::vector<uint64_t> bench_startup(
+    const char *const *args,
+    const chrono::milliseconds duration)
+{
+    using clock = chrono::steady_clock;
+    
+    posix_spawn_file_actions_t actions;
+    if(0 != ::posix_spawn_file_actions_init(&actions))
+        n_throw(runtime_error);
+    n_scope_exit() {
+        ::posix_spawn_file_actions_destroy(&actions);
+    };
+    if(0 != ::posix_spawn_file_actions_addopen(
+            &actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0))
+        n_throw(runtime_error);
+    
+    fnd::vector<uint64_t> r;
+    const clock::time_point deadline = clock::now() + duration;
+    while(r.size() < 10 || clock::now() < deadline)
+    {
+        const clock::time_point t0 = clock::now();
+        pid_t pid;
+        if(0 != ::posix_spawn(&pid, "/proc/self/exe", &actions, nullptr,
+                const_cast<char *const *>(args), environ))
+            n_throw(runtime_error);
+        int status = 0;
+        while(::waitpid(pid, &status, 0) < 0)
+            if(EINTR != errno)
+                n_throw(runtime_error);
+        const clock::time_point t1 = clock::now();
+        if(!WIFEXITED(status) || EXIT_SUCCESS != WEXITSTATUS(status))
+            n_throw(runtime_error);
+        r.push_back(uint64_t(
+            chrono::duration_cast<chrono::nanoseconds>(t1 - t0).count()));
+    }
+    std::sort(r.begin(), r.end());
+    return r;
+}
+
+} // anonymous
+
+//------------------------------------------------------------------------------
+double percentile_us(const fnd::vector<uint64_t> &ns, const double q)
+{
+    if(ns.empty())
+        return 0.0;
+    size_t k = size_t(q * double(ns.size()));
+    if(k >= ns.size())
+        k = ns.size() - 1;
+    return double(ns[k]) / 1000.0;
+}
+//------------------------------------------------------------------------------
+void run_bench(
+    const random_mode rndmode,
+    const fnd::vector<fnd::array<char32_t, 2>> &ranges,
+    const chrono::milliseconds duration,
+    const unsigned queue_depth)
+{
+    struct profile
+    {
+        const char *name;
+        fnd::vector<fnd::array<char32_t, 2>> ranges;
+    };
+    
+    fnd::vector<profile> profiles;
+    profiles.push_back({"digits", {{'0', '9' + 1}}});
+    profiles.push_back({"alnum", {{'0', '9' + 1}, {'A', 'Z' + 1},
+        {'a', 'z' + 1}}});
+    profiles.push_back({"graph", {{'!', '~' + 1}}});
+    profiles.push_back({"cjk", {{0x4E00, 0xA000}}});
+    {
+        // Too large for the flat tables, goes through the guide table.
+        profile p{"scattered", {}};
+        for(char32_t c = 0x10000; p.ranges.size() < 8192; c += 32)
+            p.ranges.emplace_back(fnd::array<char32_t, 2>{c, c + 16});
+        profiles.push_back(fnd::move(p));
+    }
+    if(!ranges.empty())
+        profiles.push_back({"config", ranges});
+    
+    // The guide table on its own: the same 2^17 characters, too many for
+    // the flat tables, cut into more and more ranges.
+    fnd::vector<profile> sweep;
+    {
+        const size_t counts[] = {1, 16, 256, 8192};
+        const char *const names[] = {
+            "ranges-1", "ranges-16", "ranges-256", "ranges-8192"};
+        for(size_t i = 0; i < 4; ++i)
+        {
+            const char32_t width = char32_t((1 << 17) / counts[i]);
+            profile p{names[i], {}};
+            for(char32_t c = 0x10000; p.ranges.size() < counts[i];
+                    c += 2 * width)
+                p.ranges.emplace_back(fnd::array<char32_t, 2>{c, c + width});
+            sweep.push_back(fnd::move(p));
+        }
+    }
+    
+    const unsigned ncpus = std::max(1u, std::thread::hardware_concurrency());
+    const random_mode modes[] = {
+        random_mode::strong,
+        random_mode::very_strong,
+        random_mode::crypt_strong,
+        random_mode::crypt_very_strong,
+        random_mode::fast_crypt};
+    const size_t lengths[] = {8, 32, 256};
+    
+    const int null_fd = ::open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if(null_fd < 0)
+        n_throw(runtime_error);
+    n_scope_exit() {
+        ::close(null_fd);
+    };
+    
+    auto has_kernel = [] (const random_mode mode, const symbol_table &tab) {
+        return ascii_kernel::supports(tab) && !drains_entropy(mode);
+    };
+    
+    fmt::fwrite(io::cout,
+        "{\n  \"version\": \"", PACKAGE_VERSION, "\",\n",
+        "  \"threads_available\": ", ncpus, ",\n",
+        "  \"ms_per_case\": ", duration.count(), ",\n",
+        "  \"results\": [");
+    bool first_case = true;
+    
+    auto report = [&] (const random_mode mode, const char *prof,
+        const size_t size, const char *kernel, const size_t length,
+        const unsigned nthreads, const uint64_t strings_per_batch,
+        const bool devnull, const bench_result &r)
+    {
+        auto percentile = [&] (const double q) {
+            return percentile_us(r.latencies, q);
+        };
+        const double chars = 0 == length ?
+            double(r.bytes) : double(r.strings) * double(length);
+        
+        gl->info("bench: ", to_cstr(mode), ' ', prof, " length=", length,
+            " threads=", nthreads, ": ",
+            double(r.bytes) / r.seconds / 1e6, " MB/s");
+        
+        fmt::fwrite(io::cout, first_case ? "\n" : ",\n",
+            "    {\"mode\": \"", to_cstr(mode), "\", ",
+            "\"profile\": \"", prof, "\", ",
+            "\"alphabet\": ", size, ", ",
+            "\"kernel\": ");
+        if(kernel)
+            fmt::fwrite(io::cout, '"', kernel, '"');
+        else
+            fmt::fwrite(io::cout, "null");
+        fmt::fwrite(io::cout, ", \"length\": ");
+        if(0 == length)
+            fmt::fwrite(io::cout, "null");
+        else
+            fmt::fwrite(io::cout, length);
+        fmt::fwrite(io::cout,
+            ", \"threads\": ", nthreads, ", ",
+            "\"output\": ", devnull ? "\"/dev/null\"" : "null", ",\n",
+            "     \"seconds\": ", r.seconds, ", ",
+            "\"bytes\": ", r.bytes, ", ",
+            "\"strings\": ", r.strings, ", ",
+            "\"batch_strings\": ", strings_per_batch, ",\n",
+            "     \"mb_per_s\": ", double(r.bytes) / r.seconds / 1e6, ", ",
+            "\"chars_per_s\": ", chars / r.seconds, ", ",
+            "\"tokens_per_s\": ");
+        if(0 == length)
+            fmt::fwrite(io::cout, "null");
+        else
+            fmt::fwrite(io::cout, double(r.strings) / r.seconds);
+        fmt::fwrite(io::cout, ",\n",
+            "     \"batch_latency_us\": {",
+            "\"p50\": ", percentile(0.5), ", ",
+            "\"p99\": ", percentile(0.99), ", ",
+            "\"p99.9\": ", percentile(0.999), ", ",
+            "\"max\": ", percentile(1.0), "}}");
+        first_case = false;
+    };
+    
+    // use_kernel = false measures the generic path on an alphabet that
+    // would get a kernel, to see what the kernel gains.
+    auto bench_strings = [&] (const random_mode mode, const profile &p,
+        const size_t length, const unsigned nthreads, const bool use_kernel,
+        const bool devnull)
+    {
+        const symbol_table tab(p.ranges);
+        fnd::optional<ascii_kernel> kernel;
+        if(use_kernel && has_kernel(mode, tab))
+            kernel = ascii_kernel(tab);
+        const ascii_kernel *kernel_ptr =
+            kernel.valid() ? &kernel.get() : nullptr;
+        
+        // Batches of about 4096 characters, timing single short strings
+        // would mostly measure the clock.
+        const uint64_t per_batch = std::max<uint64_t>(1, 4096 / length);
+        const bench_result r = bench_case(mode, nthreads,
+            per_batch * length, per_batch, duration,
+            devnull ? null_fd : -1, queue_depth,
+            [&] (auto &rnd) {
+                using rnd_type = std::decay_t<decltype(rnd)>;
+                return record_worker<rnd_type>(tab, kernel_ptr, length,
+                    delimiter_mode::newline, rnd, 4096);
+            });
+        report(mode, p.name, size_t(tab.size()),
+            kernel_ptr ? kernel_ptr->name() : nullptr,
+            length, nthreads, per_batch, devnull, r);
+    };
+    
+    // The devices on their own and with the usual alphabet.
+    for(const random_mode mode : modes)
+    {
+        with_random_mode(mode, [&] {
+            const bench_result r = bench_case(mode, 1, 1 << 16, 0,
+                duration, -1, 0,
+                [&] (auto &rnd) {
+                    using rnd_type = std::decay_t<decltype(rnd)>;
+                    return raw_worker<rnd_type>(rnd);
+                });
+            report(mode, "raw", 256, nullptr, 0, 1, 0, false, r);
+            bench_strings(mode, profiles[1], 32, 1, true, false);
+        });
+    }
+    
+    // The alphabets, lengths and threads in the selected mode.
+    with_random_mode(rndmode, [&] {
+        for(const profile &p : profiles)
+        {
+            const bool kernel = has_kernel(rndmode, symbol_table(p.ranges));
+            for(const size_t length : lengths)
+            {
+                bench_strings(rndmode, p, length, 1, true, false);
+                if(1 != ncpus)
+                    bench_strings(rndmode, p, length, ncpus, true, false);
+                if(kernel)
+                    bench_strings(rndmode, p, length, 1, false, false);
+            }
+        }
+        for(const profile &p : sweep)
+            bench_strings(rndmode, p, 32, 1, true, false);
+        
+        // With the cost of the output, an ASCII and a UTF-8 alphabet.
+        for(const profile *p : {&profiles[1], &profiles[3]})
+        {
+            bench_strings(rndmode, *p, 32, 1, true, true);
+            if(1 != ncpus)
+                bench_strings(rndmode, *p, 32, ncpus, true, true);
+        }
+    });
+    
+    fmt::fwrite(io::cout, "\n  ],\n  \"startup\": [");
+    
+#ifdef __linux__
+    // A single short string, where starting up is most of the work.
+    const char *const startup_args[][5] = {
+        {"rstr", "-a", "--length=32", "--random=strong", nullptr},
+        {"rstr", "-a", "--length=32", "--random=fast-crypt", nullptr}};
+    for(size_t i = 0; i < 2; ++i)
+    {
+        const fnd::vector<uint64_t> t =
+            bench_startup(startup_args[i], duration);
+        gl->info("bench: startup ", startup_args[i][3], ": ",
+            percentile_us(t, 0.5), " us");
+        fmt::fwrite(io::cout, 0 == i ? "\n" : ",\n",
+            "    {\"args\": \"", startup_args[i][1], ' ',
+            startup_args[i][2], ' ', startup_args[i][3], "\", ",
+            "\"runs\": ", t.size(), ", ",
+            "\"exec_to_exit_us\": {",
+            "\"p50\": ", percentile_us(t, 0.5), ", ",
+            "\"p99\": ", percentile_us(t, 0.99), ", ",
+            "\"max\": ", percentile_us(t, 1.0), "}}");
+    }
+#endif
+    
+    fmt::fwrite(io::cout, "\n  ]\n}\n");
+}
@@ -0,0 +1,46 @@
+/*--!>
+This file is part of 'rstr', a simple random string generator written in C++.
+
+Copyright 2016 outshined (outshined@riseup.net)
+    (PGP: 0x8A80C12396A4836F82A93FA79CA3D0F7E8FBCED6)
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, either version 3 of the
+License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+--------------------------------------------------------------------------<!--*/
+#ifndef RSTR_BENCH_H
+#define RSTR_BENCH_H
+
+#include "rstr/core.h"
+
+//------------------------------------------------------------------------------
+/** @param ns Durations in nanoseconds, sorted.
+ * @return The @p q quantile in microseconds.
+ */
+double percentile_us(const fnd::vector<uint64_t> &ns, const double q);
+//------------------------------------------------------------------------------
+/** Measures every RNG mode, reading raw bytes and generating strings, then
+ * a few alphabets at several lengths and thread counts in @p rndmode, one
+ * large alphabet split into more and more ranges, and the startup of short
+ * runs. Prints the results as JSON.
+ *
+ * @param ranges Benchmarked as the alphabet "config" if not empty.
+ * @param queue_depth Of the output_buffers of the cases writing to
+ *  /dev/null.
+ */
+void run_bench(
+    const random_mode rndmode,
+    const fnd::vector<fnd::array<char32_t, 2>> &ranges,
+    const chrono::milliseconds duration,
+    const unsigned queue_depth);
+
+#endif // RSTR_BENCH_H
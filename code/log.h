@@ -0,0 +1,139 @@
+/*--!>
+This file is part of 'rstr', a simple random string generator written in C++.
+
+Copyright 2016 outshined (outshined@riseup.net)
+    (PGP: 0x8A80C12396A4836F82A93FA79CA3D0F7E8FBCED6)
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, either version 3 of the
+License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+--------------------------------------------------------------------------<!--*/
+#ifndef RSTR_LOG_H
+#define RSTR_LOG_H
+
+#include "rstr/core.h"
+
+#include <nebula/foundation/qlog.h>
+
+#include <mutex>
+
+//------------------------------------------------------------------------------
+inline static auto init_log() noexcept
+{
+    namespace qlog = fnd::qlog;
+    
+    try
+    {
+        fnd::intrusive_ptr<qlog::logger> log(new qlog::logger());
+        log->formatter(qlog::formatter::capture(
+            [] (qlog::level lvl, fnd::string &s){
+                io::msink<fnd::string> ss;
+                fmt::fwrite(ss, 
+                    "[ ", qlog::to_cstr(lvl), " ] ", s);
+                s = fnd::move(ss.container());
+            }));
+        qlog::sink::init_console();
+        log->sink(qlog::sink::console());
+        log->error_handler(
+            [&] (fnd::exception_ptr x) {
+                try {
+                    fmt::fwrite(io::cerr, 
+                        "*** Log Error ***", fmt::endl,
+                        fnd::diagnostic_information(fnd::current_exception()),
+                        fmt::endl);
+                } catch(...) {} // eat exception
+            });
+        return log;
+    }
+    catch(...)
+    {
+        fmt::fwrite(io::cerr, 
+            "*** Log Error ***", fmt::endl,
+            fnd::diagnostic_information(fnd::current_exception()),
+            fmt::endl);
+        throw; // terminate
+    }
+}
+//------------------------------------------------------------------------------
+/** Sets the logger up when the first message passes the threshold, so a run
+ * which logs nothing doesn't pay for the allocations and the console.
+ */
+class lazy_logger
+{
+public:
+    using level = fnd::qlog::level;
+    
+    inline lazy_logger *operator -> () noexcept {
+        return this;
+    }
+    
+    template <class ... T>
+    inline void debug(const T & ... x) {
+        if(passes(level::debug))
+            get()->debug(x...);
+    }
+    template <class ... T>
+    inline void info(const T & ... x) {
+        if(passes(level::info))
+            get()->info(x...);
+    }
+    template <class ... T>
+    inline void warning(const T & ... x) {
+        if(passes(level::warning))
+            get()->warning(x...);
+    }
+    template <class ... T>
+    inline void error(const T & ... x) {
+        if(passes(level::error))
+            get()->error(x...);
+    }
+    template <class ... T>
+    inline void fatal(const T & ... x) {
+        if(passes(level::fatal))
+            get()->fatal(x...);
+    }
+    
+    /** Must not be called while other threads are logging.
+     */
+    inline void threshold(const level lvl)
+    {
+        threshold_ = lvl;
+        if(log_)
+            log_->threshold(lvl);
+    }
+    inline level threshold() const noexcept {
+        return threshold_;
+    }
+    
+private:
+    inline bool passes(const level lvl) const noexcept {
+        return lvl >= threshold_;
+    }
+    inline const fnd::intrusive_ptr<fnd::qlog::logger> &get()
+    {
+        std::call_once(once_, [this] {
+            log_ = init_log();
+            log_->threshold(threshold_);
+        });
+        return log_;
+    }
+    
+    level threshold_ = level::warning;
+    std::once_flag once_;
+    fnd::intrusive_ptr<fnd::qlog::logger> log_;
+};
+//------------------------------------------------------------------------------
+/** The logger of the command line, defined in main.cpp.
+ */
+extern lazy_logger gl;
+
+#endif // RSTR_LOG_H
@@ -17,29 +17,25 @@ GNU Affero General Public License for more details.
 You should have received a copy of the GNU Affero General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>.
 --------------------------------------------------------------------------<!--*/
-#include <nebula/foundation/exception.h>
-#include <nebula/foundation/format.h>
-#include <nebula/foundation/cstring.h>
+// The CLI is built on the internals of librstr rather than on rstr.h: it
+// streams records in order from several threads, writes --raw output, keeps
+// token pools and reports the entropy used, none of which the public API
+// exposes. The parser, samplers, tables and kernels are librstr's own, so
+// nothing is generated differently from rstr::generate().
+#include "bench.h"
+#include "serve.h"
+#include "worker.h"
+
 #include <nebula/foundation/filesystem.h>
 #include <nebula/foundation/scope_exit.h>
 #include <nebula/foundation/opts.h>
-#include <nebula/foundation/qlog.h>
-#include <nebula/foundation/random.h>
-#include <nebula/foundation/utf.h>
-#include <nebula/foundation/expect.h>
-#include <nebula/sex/sex.h>
-#include <nebula/crypt/crypt.h>
-
-namespace fnd = nebula::foundation;
-namespace fmt = fnd::fmt;
-namespace io = fnd::io;
-namespace sex = nebula::sex;
-namespace chrono = fnd::chrono;
-namespace ncrypt = nebula::crypt;
 
-//------------------------------------------------------------------------------
-struct runtime_error : public virtual fnd::runtime_error {};
-struct logic_error : public virtual fnd::logic_error {};
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include <type_traits>
 
 //------------------------------------------------------------------------------
 const fnd::const_cstring program_author = "outshined (outshined@riseup.net)";
@@ -93,11 +89,21 @@ inline void print_help(const fnd::const_cstring argv0)
 "  (U+0041 U+005A) // Same as (A Z).", fmt::endl,
 "  (U+0041 Z) // Same as (A Z).", fmt::endl,
 "  (U+41 Z) // Leading zeros can be omitted.", fmt::endl,
-"  (A) // Add only a single letter.", fmt::endl, fmt::endl,
+"  (A) // Add only a single letter.", fmt::endl,
+"  (class Letter) // Add a Unicode General_Category like Lu, Nd or Letter.", fmt::endl,
+"  (script Hiragana) // Add the characters of a Unicode script.", fmt::endl,
+"  (exclude Cc) // Remove a category from this config, here the control", fmt::endl,
+"               // characters. (exclude script Latin) works as well.", fmt::endl, fmt::endl,
 
 "  // Characters other than (A Z)(a z)(0 9) must be put inside double quotes:", fmt::endl,
 "  (\"あ\" \"わ\")", fmt::endl, fmt::endl,
 
+"A template gives every position its own characters, instead of --length:", fmt::endl,
+"  (template (4 (A Z)(0 9)) \"-\" (4 (A Z)(0 9)) \"-\" (4 (0 9)))", fmt::endl,
+"  // Four letters or digits, a dash, ..., four digits.", fmt::endl,
+"  (template (16 (a z)(A Z) (at-least 2 (0 9)) (at-least 1 (\"!\" \"/\"))))", fmt::endl,
+"  // 16 characters, at least two digits and one symbol, in random places.", fmt::endl, fmt::endl,
+
 "  // Comment", fmt::endl,
 "  /* Multiline", fmt::endl,
 "   * Comment", fmt::endl,
@@ -112,7 +118,12 @@ inline void print_help(const fnd::const_cstring argv0)
 
 "-v --verbose   Verbose output.", fmt::endl,
 "-l --length    The number of characters to generate. [32]", fmt::endl,
-"-w --raw       Output a random byte stream of --length bytes", fmt::endl,
+"-n --count     The number of strings to generate. [1]", fmt::endl,
+"-d --delimiter What to put after each string. [newline]", fmt::endl,
+"                   newline ... A line feed.", fmt::endl,
+"                   nul ... A NUL byte, see 'xargs -0'.", fmt::endl,
+"                   none ... Nothing, the strings are fixed-width records.", fmt::endl,
+"-w --raw       Output a random byte stream of --length times --count bytes", fmt::endl,
 "               of raw data coming directly from the random number generator.", fmt::endl,
 "-r --random    Quality of the random number generator. [crypt-strong]", fmt::endl,
 "                   strong ... Generate strong random numbers quickly.", fmt::endl,
@@ -120,17 +131,64 @@ inline void print_help(const fnd::const_cstring argv0)
 "                       Drains the system's entropy pool!", fmt::endl,
 "                   crypt-strong ... Like strong but using Nebula.Crypt.", fmt::endl,
 "                   crypt-very-strong ... You get the idea.", fmt::endl,
-"-c --config    Load a config file.", fmt::endl,
+"                   fast-crypt ... ChaCha20 seeded from crypt-very-strong.", fmt::endl,
+"                       Very fast and still cryptographically strong.", fmt::endl,
+"-t --threads   Number of threads generating output, 0 for one per core. [1]", fmt::endl,
+"               The output is the same as with a single thread, just faster.", fmt::endl,
+"--block-size   Number of bytes read from the RNG at once. [4096]", fmt::endl,
+"               Use small values with very-strong to save entropy.", fmt::endl,
+"--buffer-size  Size of the buffers used by --raw in bytes. [1048576]", fmt::endl,
+"-o --output    Write to this file or block device instead of stdout.", fmt::endl,
+"               Files are truncated unless --offset is given.", fmt::endl,
+"--offset       Start writing at this byte offset of --output. [0]", fmt::endl,
+"--queue-depth  Number of writes kept in flight using io_uring, 0 to use", fmt::endl,
+"               plain blocking writes instead. [4]", fmt::endl,
+"--direct       Bypass the page cache using O_DIRECT. Requires --output,", fmt::endl,
+"               --raw, a single thread and a page aligned --offset.", fmt::endl,
+"--serve        Answer requests on this UNIX socket until SIGINT or SIGTERM.", fmt::endl,
+"               Requests are lines 'COUNT LENGTH [CONFIG]', answered with", fmt::endl,
+"               'OK SIZE' and SIZE bytes of strings, or 'ERR MESSAGE'.", fmt::endl,
+"               Without CONFIG the alphabet of the server is used.", fmt::endl,
+"--connect      Get the strings from a server started with --serve.", fmt::endl,
+"--load         Send this many requests of --count strings to --connect", fmt::endl,
+"               over --threads connections, then print the throughput", fmt::endl,
+"               and latency instead of the strings.", fmt::endl,
+"--pipeline     Requests sent ahead of the answers by --connect. [16]", fmt::endl,
+"--pool         Keep this many strings ready in locked memory for each", fmt::endl,
+"               alphabet and length asked for by clients of --serve. A", fmt::endl,
+"               thread refills a pool when it drops below --pool-low. [0]", fmt::endl,
+"               At most 64 pools are made, taking up to 1 GiB in all.", fmt::endl,
+"--pool-low     Low-water mark of the pools, at least 1. [half of --pool]", fmt::endl,
+"--pool-stats   Print the pools of the server given by --connect.", fmt::endl,
+"--stats        Print the time spent on crypt init, reading entropy,", fmt::endl,
+"               selecting characters, UTF-8 encoding and output at exit,", fmt::endl,
+"               added up over all threads. --stats=json prints JSON to", fmt::endl,
+"               stderr instead.", fmt::endl,
+"--bench        Measure every RNG mode, then some alphabets at several", fmt::endl,
+"               lengths and thread counts in the --random mode, and print", fmt::endl,
+"               the results as JSON. The alphabet given, if any, is", fmt::endl,
+"               measured as well, and so is the startup of 'rstr -a -l 32'.", fmt::endl,
+"               ASCII alphabets are also measured without their kernel,", fmt::endl,
+"               reported with \"kernel\": null. 2^17 characters in 1 to", fmt::endl,
+"               8192 ranges measure the lookup of large alphabets. Two", fmt::endl,
+"               alphabets are also written to /dev/null through the output", fmt::endl,
+"               buffers, reported with \"output\": \"/dev/null\".", fmt::endl,
+"               Takes the milliseconds per case. [200]", fmt::endl,
+"-c --config    Load a config file, or one saved by --compile-config.", fmt::endl,
+"--compile-config", fmt::endl,
+"               Save the alphabet to this file and exit. Loading it with", fmt::endl,
+"               -c maps the lookup tables instead of building them.", fmt::endl,
 "-A --AZ        Add (A Z): ABCDEFGHIJKLMNOPQRSTUVWXYZ", fmt::endl,
 "-a --az        Add (a z): abcdefghijklmnopqrstuvwxyz", fmt::endl,
 "-0 --09        Add (0 9): 0123456789", fmt::endl,
 "-x             Add: !\"#$%&'()*+,-./:;<=>?@[\\]^_`{|}~", fmt::endl,
+"--unique-chars Add every character only once, even if ranges overlap.", fmt::endl,
 "--show-ascii   Print a simple ASCII table and exit.", fmt::endl, fmt::endl,
 
 "NOTE: This program works with UTF-8 strings only.", fmt::endl,
-"NOTE: The program doesn't check if a character has already been added.", fmt::endl,
-"      Adding characters multiple times (through overlapping ranges) increases", fmt::endl,
-"      the relative likelihood that it gets picked.", fmt::endl);
+"NOTE: Unless --unique-chars is given, adding characters multiple times", fmt::endl,
+"      (through overlapping ranges) increases the relative likelihood that", fmt::endl,
+"      they get picked. Use --verbose to see the entropy per character.", fmt::endl);
 }
 //------------------------------------------------------------------------------
 inline void print_ascii_table()
@@ -152,324 +210,91 @@ inline void print_ascii_table()
 }
 
 //------------------------------------------------------------------------------
-fnd::intrusive_ptr<fnd::qlog::logger> gl;
-//------------------------------------------------------------------------------
-inline static auto init_log() noexcept
-{
-    namespace qlog = fnd::qlog;
-    
-    try
-    {
-        gl = new qlog::logger();
-        gl->threshold(qlog::level::warning);
-        gl->formatter(qlog::formatter::capture(
-            [] (qlog::level lvl, fnd::string &s){
-                io::msink<fnd::string> ss;
-                fmt::fwrite(ss, 
-                    "[ ", qlog::to_cstr(lvl), " ] ", s);
-                s = fnd::move(ss.container());
-            }));
-        qlog::sink::init_console();
-        gl->sink(qlog::sink::console());
-        gl->error_handler(
-            [&] (fnd::exception_ptr x) {
-                try {
-                    fmt::fwrite(io::cerr, 
-                        "*** Log Error ***", fmt::endl,
-                        fnd::diagnostic_information(fnd::current_exception()),
-                        fmt::endl);
-                } catch(...) {} // eat exception
-            });
-    }
-    catch(...)
-    {
-        fmt::fwrite(io::cerr, 
-            "*** Log Error ***", fmt::endl,
-            fnd::diagnostic_information(fnd::current_exception()),
-            fmt::endl);
-        throw; // terminate
-    }
-}
+lazy_logger gl;
 
+#ifdef RSTR_STATS
 //------------------------------------------------------------------------------
-enum class errc
+/** Prints the time spent in each stage since enable_stats(), through gl or
+ * as JSON to stderr. The times of all threads are added up.
+ */
+inline void print_stats(const bool json)
 {
-    unknown = -1,
-    success = 0,
-    
-    // Parsing errors
-    expected_lbracket,
-    expected_rbracket,
-    expected_string,
-    invalid_number,
-    invalid_range,
-    inverted_range,
-    expected_single_character,
+    const double seconds = stats_seconds();
+    const double rate = stats_tick_rate();
     
-    // Mapped sex errors
-    unexpected_eof,
-    invalid_token,
-    stray_rbracket,
-    missing_rbracket,
-    unexpected_token
-};
-//------------------------------------------------------------------------------
-inline errc to_errc(const sex::errc x) noexcept {
-    switch(x)
-    {
-    case sex::errc::unexpected_eof: return errc::unexpected_eof;
-    case sex::errc::invalid_token: return errc::invalid_token;
-    case sex::errc::stray_rbracket: return errc::stray_rbracket;
-    case sex::errc::missing_rbracket: return errc::missing_rbracket;
-    case sex::errc::unexpected_token: return errc::unexpected_token;
-    default: return errc::unknown;
-    }
-}
-//------------------------------------------------------------------------------
-class app_error_category_impl : public fnd::system::error_category
-{
-public:
-    app_error_category_impl() = default;
-
-    inline const char *name() const noexcept {
-        return "app";
-    }
-    inline fnd::string message(fnd::system::errval_t e) const
+    if(json)
     {
-        using fnd::system::errval_t;
-        
-        switch(e)
+        fmt::fwrite(io::cerr, "{\"seconds\": ", seconds,
+            ", \"ticks_per_second\": ", rate, ", \"stages\": {");
+        for(size_t i = 0; i < stage_count; ++i)
         {
-        case static_cast<errval_t>(errc::success):
-            return "Everything went fine.";
-        case static_cast<errval_t>(errc::expected_lbracket):
-            return "Expected left bracket.";
-        case static_cast<errval_t>(errc::expected_rbracket):
-            return "Expected right bracket.";
-        case static_cast<errval_t>(errc::expected_string):
-            return "Expected a String.";
-        case static_cast<errval_t>(errc::invalid_number):
-            return "Expected a number in the range (U+0 U+1FFFFF).";
-        case static_cast<errval_t>(errc::invalid_range):
-            return "The range is not valid.";
-        case static_cast<errval_t>(errc::inverted_range):
-            return "The range is inverted.";
-        case static_cast<errval_t>(errc::expected_single_character):
-            return "Expected a single character.";
-        case static_cast<errval_t>(errc::unexpected_eof):
-            return "Unexpected EOF.";
-        case static_cast<errval_t>(errc::invalid_token):
-            return "Invalid token.";
-        case static_cast<errval_t>(errc::stray_rbracket):
-            return "Stray right bracket ')' without a matching '('.";
-        case static_cast<errval_t>(errc::missing_rbracket):
-            return "Missing right bracket ')'.";
-        case static_cast<errval_t>(errc::unexpected_token):
-            return "Unexpected token.";
-        default: return "unknown";
+            const stage_totals t = read_stats(stage(i));
+            fmt::fwrite(io::cerr, 0 == i ? "" : ", ",
+                '"', to_cstr(stage(i)), "\": {",
+                "\"seconds\": ", double(t.ticks) / rate, ", ",
+                "\"calls\": ", t.calls, ", ",
+                "\"bytes\": ", t.bytes, '}');
         }
+        fmt::fwrite(io::cerr, "}}", fmt::endl);
+        return;
     }
-
-    inline fnd::system::error_condition default_error_condition(
-        fnd::system::errval_t e) const noexcept
-    {
-        return fnd::system::error_condition(e, *this);
-    }
-};
-
-//------------------------------------------------------------------------------
-const fnd::system::error_category &app_error_category() noexcept {
-    static app_error_category_impl r;
-    return r;
-}
-
-//------------------------------------------------------------------------------
-n_register_error_code_enum(::errc, ::app_error_category());
-n_register_error_condition_enum(::errc, ::app_error_category());
-
-//------------------------------------------------------------------------------
-enum class random_mode
-{
-    strong,
-    very_strong,
-    crypt_strong,
-    crypt_very_strong
-};
-
-//------------------------------------------------------------------------------
-inline fnd::expect<char32_t, errc> parse_value(fnd::const_cstring s)
-{
-    if(s.empty())
-        return errc::expected_string;
     
-    if('U' == s[0] && s.size() > 1)
+    if(gl->threshold() > fnd::qlog::level::info)
+        gl->threshold(fnd::qlog::level::info);
+    gl->info("Time per stage over ", seconds, " s:");
+    for(size_t i = 0; i < stage_count; ++i)
     {
-        if(s.size() < 3)
-            return errc::invalid_number;
-        if('+' == s[1])
-        {
-            s = {s.begin() + 2, s.end()};
-            const char *i = fnd::range::find(s, '0', fnd::not_equal_to<>());
-            if(s.end() == i)
-                return static_cast<char32_t>(0);
-            auto r = fnd::fmt::to_integer<uint32_t>(
-                {i, s.end()}, 16, fnd::nothrow_tag());
-            if(!r.valid())
-                return errc::invalid_number;
-            if(2097151 < r.get())
-                return errc::invalid_number;
-            return static_cast<char32_t>(r.get());
-        }
+        const stage_totals t = read_stats(stage(i));
+        if(0 == t.calls)
+            continue;
+        const double s = double(t.ticks) / rate;
+        if(0 == t.bytes)
+            gl->info("  ", to_cstr(stage(i)), ": ", s * 1e3, " ms (",
+                std::round(s / seconds * 1000) / 10, "%), ",
+                t.calls, " calls");
         else
-            return errc::invalid_number;
-    }
-    else
-    {
-        if(fnd::utf::unsafe_count(s) != 1)
-            return errc::expected_single_character;
-        return fnd::utf::widen(s);
-    }
-}
-//------------------------------------------------------------------------------
-inline fnd::tuple<errc, size_t> parse_config(
-    const fnd::const_cstring s,
-    fnd::vector<fnd::array<char32_t, 2>> &v)
-{
-    sex::iterative_parser<fnd::const_cstring> sexp(s);
-    
-    while(true)
-    {
-        fnd::optional<sex::token> tok_ = sexp();
-        if(!tok_.valid())
-            return {to_errc(sexp.error()), sexp.position()};
-        sex::token tok = tok_.get();
-        if(sex::token_id::eof == tok.id())
-            break;
-        else if(sex::token_id::lbracket != tok.id())
-            return {errc::expected_lbracket, tok.value().begin() - s.begin()};
-        
-        auto r = sexp.parse_any_string();
-        if(!r.valid())
-            return {to_errc(sexp.error()), sexp.position()};
-        
-        char32_t beg = 0;
-        {
-            auto ret = parse_value(r.get());
-            if(!ret.valid())
-                return {ret.error(), r.get().begin() - s.begin()};
-            beg = ret.get();
-        }
-        char32_t end = beg;
-        
-        tok_ = sexp();
-        if(!tok_.valid())
-            return {to_errc(sexp.error()), sexp.position()};
-        tok = tok_.get();
-        if(sex::token_id::string == tok.id()
-            || sex::token_id::quoted_string == tok.id()
-            || sex::token_id::data == tok.id())
-        {
-            auto ret = parse_value(tok.value());
-            if(!ret.valid())
-                return {ret.error(), tok.value().begin() - s.begin()};
-            end = ret.get();
-            
-            if(beg > end)
-                return {errc::inverted_range, tok.value().begin() - s.begin()};
-            
-            tok_ = sexp();
-            if(!tok_.valid())
-                return {to_errc(sexp.error()), sexp.position()};
-            tok = tok_.get();
-        }
-        
-        if(sex::token_id::rbracket != tok.id())
-            return {errc::expected_rbracket, tok.value().begin() - s.begin()};
-        
-        v.emplace_back(fnd::array<char32_t, 2>{beg, end + 1});
-    }
-    
-    return {errc::success, 0};
-}
-
-//------------------------------------------------------------------------------
-template <class Range, class Rnd, class Out>
-inline void gen_from_ranges(
-    const Range &ranges,
-    const size_t length,
-    Rnd &rnd,
-    Out &&out)
-{
-    if(ranges.empty())
-        n_throw(logic_error);
-    
-    fnd::vector<uint64_t> weights;
-    weights.resize(ranges.size(), 0);
-    
-    for(size_t i = 0; i < ranges.size(); ++i)
-    {
-        auto &r = ranges[i];
-        weights[i] = r[1] - r[0];
-    }
-    for(size_t i = 1; i < ranges.size(); ++i)
-    {
-        weights[i] = weights[i-1] + weights[i];
-    }
-    
-    for(size_t i = 0; i < length; ++i)
-    {
-        uint64_t n = 0;
-        io::read(rnd, reinterpret_cast<char *>(&n), sizeof(n));
-        
-        size_t indx = 0;
-        {
-            const uint64_t rnd_w = n % (weights.back()+1);
-            auto fi = fnd::range::find_if(weights,
-                [rnd_w] (const uint64_t x) {
-                    return rnd_w <= x;
-                });
-            if(weights.end() == fi) // paranoid
-                n_throw(logic_error);
-            indx = fi - weights.begin();
-        }
-        const auto r = ranges[indx];
-        
-        out(fnd::utf::narrow(r[0] + (char32_t(n) % (r[1]-r[0]))));
-    }
-}
-
-//------------------------------------------------------------------------------
-template <class Rnd>
-inline void dump_raw(size_t length, Rnd &rnd)
-{
-    fnd::array<char, 4096> buf;
-    for(size_t i = 0; i < length; )
-    {
-        const size_t delta = 4096 <= length - i ? 4096 : length - i;
-        io::read(rnd, buf.data(), delta);
-        io::write(io::cout, buf.data(), delta);
-        i += delta;
+            gl->info("  ", to_cstr(stage(i)), ": ", s * 1e3, " ms (",
+                std::round(s / seconds * 1000) / 10, "%), ",
+                t.calls, " calls, ", t.bytes, " bytes, ",
+                s > 0 ? double(t.bytes) / s / 1e6 : 0.0, " MB/s");
     }
 }
-//------------------------------------------------------------------------------
-inline void init_crypt()
-{
-    ncrypt::config cfg;
-    cfg.secure_random_pool = true;
-    ncrypt::init(cfg);
-}
+#endif
 
 //------------------------------------------------------------------------------
 int main(int argc, char **argv)
 {
-    init_log();
-    
     try {
         fnd::vector<fnd::array<char32_t, 2>> ranges;
         int quit = -1;
         size_t length = 32;
+        size_t count = 1;
+        size_t block_size = 4096;
+        unsigned nthreads = 1;
+        size_t buffer_size = 1 << 20;
+        fnd::vector<char> output_path;
+        uint64_t offset = 0;
+        bool direct = false;
+        unsigned queue_depth = 4;
+        fnd::vector<char> serve_path;
+        fnd::vector<char> connect_path;
+        uint64_t load = 0;
+        unsigned pipeline = 16;
+        size_t pool_size = 0;
+        fnd::optional<size_t> pool_low;
+        bool pool_stats = false;
+        delimiter_mode delim = delimiter_mode::newline;
         random_mode rndmode = random_mode::crypt_strong;
         bool raw = false;
+        bool unique_chars = false;
+        fnd::vector<char> compile_path;
+        std::unique_ptr<mapped_charset> compiled;
+        token_template tpl;
+        fnd::optional<unsigned> bench_ms;
+#ifdef RSTR_STATS
+        bool stats = false;
+        bool stats_json = false;
+#endif
         
         for(int i = 1; i < argc; ++i) {
             const fnd::const_cstring s(argv[i]);
@@ -495,7 +320,7 @@ int main(int argc, char **argv)
                 }
                 errc err;
                 size_t pos;
-                fnd::tie(err, pos) = parse_config(val, ranges);
+                fnd::tie(err, pos) = parse_config(val, ranges, nullptr, &tpl);
                 if(errc::success != err) {
                     quit = EXIT_FAILURE;
                     gl->error(
@@ -557,6 +382,9 @@ int main(int argc, char **argv)
                     else if(val == "crypt-very-strong") {
                         rndmode = random_mode::crypt_very_strong;
                     }
+                    else if(val == "fast-crypt") {
+                        rndmode = random_mode::fast_crypt;
+                    }
                     else
                     {
                         quit = EXIT_FAILURE;
@@ -588,6 +416,303 @@ int main(int argc, char **argv)
                     return true;
                 },
                 "length", "l"),
+            fnd::opts::argument(
+                [&] (fnd::const_cstring id, fnd::const_cstring val, size_t i) {
+                    if(val.empty())
+                    {
+                        quit = EXIT_FAILURE;
+                        gl->error("Missing value. '-", id, "=???'.");
+                        return false;
+                    }
+                    fnd::optional<size_t> x = fmt::to_integer<size_t>(
+                        val, 10, fnd::nothrow_tag());
+                    if(!x.valid())
+                    {
+                        quit = EXIT_FAILURE;
+                        gl->error("Invalid number. '-",
+                            id, "=#ERROR'");
+                        return false;
+                    }
+                    count = x.get();
+                    return true;
+                },
+                "count", "n"),
+            fnd::opts::argument(
+                [&] (fnd::const_cstring id, fnd::const_cstring val, size_t i) {
+                    if(val.empty())
+                    {
+                        quit = EXIT_FAILURE;
+                        gl->error("Missing value. '-", id, "=???'.");
+                        return false;
+                    }
+                    fnd::optional<size_t> x = fmt::to_integer<size_t>(
+                        val, 10, fnd::nothrow_tag());
+                    if(!x.valid() || 0 == x.get())
+                    {
+                        quit = EXIT_FAILURE;
+                        gl->error("Invalid number. '-",
+                            id, "=#ERROR'");
+                        return false;
+                    }
+                    block_size = x.get();
+                    return true;
+                },
+                "block-size"),
+            fnd::opts::argument(
+                [&] (fnd::const_cstring id, fnd::const_cstring val, size_t i) {
+                    if(val.empty())
+                    {
+                        quit = EXIT_FAILURE;
+                        gl->error("Missing value. '-", id, "=???'.");
+                        return false;
+                    }
+                    fnd::optional<size_t> x = fmt::to_integer<size_t>(
+                        val, 10, fnd::nothrow_tag());
+                    if(!x.valid() || 0 == x.get())
+                    {
+                        quit = EXIT_FAILURE;
+                        gl->error("Invalid number. '-",
+                            id, "=#ERROR'");
+                        return false;
+                    }
+                    buffer_size = x.get();
+                    return true;
+                },
+                "buffer-size"),
+            fnd::opts::argument(
+                [&] (fnd::const_cstring id, fnd::const_cstring val, size_t i) {
+                    if(val.empty())
+                    {
+                        quit = EXIT_FAILURE;
+                        gl->error("Missing value. '-", id, "=???'.");
+                        return false;
+                    }
+                    output_path.assign(val.begin(), val.end());
+                    output_path.push_back('\0');
+                    return true;
+                },
+                "output", "o"),
+            fnd::opts::argument(
+                [&] (fnd::const_cstring id, fnd::const_cstring val, size_t i) {
+                    if(val.empty())
+                    {
+                        quit = EXIT_FAILURE;
+                        gl->error("Missing value. '-", id, "=???'.");
+                        return false;
+                    }
+                    fnd::optional<uint64_t> x = fmt::to_integer<uint64_t>(
+                        val, 10, fnd::nothrow_tag());
+                    if(!x.valid())
+                    {
+                        quit = EXIT_FAILURE;
+                        gl->error("Invalid number. '-",
+                            id, "=#ERROR'");
+                        return false;
+                    }
+                    offset = x.get();
+                    return true;
+                },
+                "offset"),
+            fnd::opts::argument(
+                [&] (fnd::const_cstring id, fnd::const_cstring val, size_t i) {
+                    if(!val.empty())
+                        gl->warning("Value ignored. '-", id, "' is a flag.");
+                    direct = true;
+                    return true;
+                },
+                "direct"),
+            fnd::opts::argument(
+                [&] (fnd::const_cstring id, fnd::const_cstring val, size_t i) {
+                    if(val.empty())
+                    {
+                        quit = EXIT_FAILURE;
+                        gl->error("Missing value. '-", id, "=???'.");
+                        return false;
+                    }
+                    fnd::optional<unsigned> x = fmt::to_integer<unsigned>(
+                        val, 10, fnd::nothrow_tag());
+                    if(!x.valid() || x.get() > 4096)
+                    {
+                        quit = EXIT_FAILURE;
+                        gl->error("Invalid number. '-",
+                            id, "=#ERROR'");
+                        return false;
+                    }
+                    queue_depth = x.get();
+                    return true;
+                },
+                "queue-depth"),
+            fnd::opts::argument(
+                [&] (fnd::const_cstring id, fnd::const_cstring val, size_t i) {
+                    if(val.empty())
+                    {
+                        quit = EXIT_FAILURE;
+                        gl->error("Missing value. '-", id, "=???'.");
+                        return false;
+                    }
+                    serve_path.assign(val.begin(), val.end());
+                    serve_path.push_back('\0');
+                    return true;
+                },
+                "serve"),
+            fnd::opts::argument(
+                [&] (fnd::const_cstring id, fnd::const_cstring val, size_t i) {
+                    if(val.empty())
+                    {
+                        quit = EXIT_FAILURE;
+                        gl->error("Missing value. '-", id, "=???'.");
+                        return false;
+                    }
+                    connect_path.assign(val.begin(), val.end());
+                    connect_path.push_back('\0');
+                    return true;
+                },
+                "connect"),
+            fnd::opts::argument(
+                [&] (fnd::const_cstring id, fnd::const_cstring val, size_t i) {
+                    if(val.empty())
+                    {
+                        quit = EXIT_FAILURE;
+                        gl->error("Missing value. '-", id, "=???'.");
+                        return false;
+                    }
+                    fnd::optional<uint64_t> x = fmt::to_integer<uint64_t>(
+                        val, 10, fnd::nothrow_tag());
+                    if(!x.valid() || 0 == x.get())
+                    {
+                        quit = EXIT_FAILURE;
+                        gl->error("Invalid number. '-",
+                            id, "=#ERROR'");
+                        return false;
+                    }
+                    load = x.get();
+                    return true;
+                },
+                "load"),
+            fnd::opts::argument(
+                [&] (fnd::const_cstring id, fnd::const_cstring val, size_t i) {
+                    if(val.empty())
+                    {
+                        quit = EXIT_FAILURE;
+                        gl->error("Missing value. '-", id, "=???'.");
+                        return false;
+                    }
+                    fnd::optional<unsigned> x = fmt::to_integer<unsigned>(
+                        val, 10, fnd::nothrow_tag());
+                    if(!x.valid() || 0 == x.get())
+                    {
+                        quit = EXIT_FAILURE;
+                        gl->error("Invalid number. '-",
+                            id, "=#ERROR'");
+                        return false;
+                    }
+                    pipeline = x.get();
+                    return true;
+                },
+                "pipeline"),
+            fnd::opts::argument(
+                [&] (fnd::const_cstring id, fnd::const_cstring val, size_t i) {
+                    if(val.empty())
+                    {
+                        quit = EXIT_FAILURE;
+                        gl->error("Missing value. '-", id, "=???'.");
+                        return false;
+                    }
+                    fnd::optional<size_t> x = fmt::to_integer<size_t>(
+                        val, 10, fnd::nothrow_tag());
+                    if(!x.valid())
+                    {
+                        quit = EXIT_FAILURE;
+                        gl->error("Invalid number. '-",
+                            id, "=#ERROR'");
+                        return false;
+                    }
+                    pool_size = x.get();
+                    return true;
+                },
+                "pool"),
+            fnd::opts::argument(
+                [&] (fnd::const_cstring id, fnd::const_cstring val, size_t i) {
+                    if(val.empty())
+                    {
+                        quit = EXIT_FAILURE;
+                        gl->error("Missing value. '-", id, "=???'.");
+                        return false;
+                    }
+                    fnd::optional<size_t> x = fmt::to_integer<size_t>(
+                        val, 10, fnd::nothrow_tag());
+                    if(!x.valid() || 0 == x.get())
+                    {
+                        quit = EXIT_FAILURE;
+                        gl->error("Invalid number. '-",
+                            id, "=#ERROR'");
+                        return false;
+                    }
+                    pool_low = x.get();
+                    return true;
+                },
+                "pool-low"),
+            fnd::opts::argument(
+                [&] (fnd::const_cstring id, fnd::const_cstring val, size_t i) {
+                    if(!val.empty())
+                        gl->warning("Value ignored. '-", id, "' is a flag.");
+                    pool_stats = true;
+                    return true;
+                },
+                "pool-stats"),
+            fnd::opts::argument(
+                [&] (fnd::const_cstring id, fnd::const_cstring val, size_t i) {
+                    if(val.empty())
+                    {
+                        quit = EXIT_FAILURE;
+                        gl->error("Missing value. '-", id, "=???'.");
+                        return false;
+                    }
+                    fnd::optional<unsigned> x = fmt::to_integer<unsigned>(
+                        val, 10, fnd::nothrow_tag());
+                    if(!x.valid())
+                    {
+                        quit = EXIT_FAILURE;
+                        gl->error("Invalid number. '-",
+                            id, "=#ERROR'");
+                        return false;
+                    }
+                    nthreads = x.get();
+                    if(0 == nthreads)
+                    {
+                        nthreads = std::thread::hardware_concurrency();
+                        if(0 == nthreads)
+                            nthreads = 1;
+                    }
+                    return true;
+                },
+                "threads", "t"),
+            fnd::opts::argument(
+                [&] (fnd::const_cstring id, fnd::const_cstring val, size_t i) {
+                    if(val.empty())
+                    {
+                        quit = EXIT_FAILURE;
+                        gl->error("Missing value. '-", id, "=???'.");
+                        return false;
+                    }
+                    if(val == "newline") {
+                        delim = delimiter_mode::newline;
+                    }
+                    else if(val == "nul") {
+                        delim = delimiter_mode::nul;
+                    }
+                    else if(val == "none") {
+                        delim = delimiter_mode::none;
+                    }
+                    else
+                    {
+                        quit = EXIT_FAILURE;
+                        gl->error("Invalid delimiter. '-", id, "=#ERROR'.");
+                        return false;
+                    }
+                    return true;
+                },
+                "delimiter", "d"),
             fnd::opts::argument(
                 [&] (fnd::const_cstring id, fnd::const_cstring val, size_t i) {
                     if(!val.empty())
@@ -631,6 +756,14 @@ int main(int argc, char **argv)
                     return true;
                 },
                 "special", "x"),
+            fnd::opts::argument(
+                [&] (fnd::const_cstring id, fnd::const_cstring val, size_t i) {
+                    if(!val.empty())
+                        gl->warning("Value ignored. '-", id, "' is a flag.");
+                    unique_chars = true;
+                    return true;
+                },
+                "unique-chars"),
             
             fnd::opts::argument(
                 [&] (fnd::const_cstring id, fnd::const_cstring val, size_t i) {
@@ -640,52 +773,109 @@ int main(int argc, char **argv)
                         gl->error("Missing value. '-", id, "=???'.");
                         return false;
                     }
-                    fnd::io::ifstream f;
-                    try {
-                        f.open(val);
-                    } catch(...) {
-                        gl->error("Unable to open config file '", val, "'. ",
-                            "Ensure that it exists and is readable.");
-                        gl->debug(fnd::diagnostic_information(
-                            fnd::current_exception()));
-                        quit = EXIT_FAILURE;
-                        return false;
-                    }
-                    fnd::io::seekg_end(f, 0);
-                    const size_t n = fnd::io::tellg(f);
-                    fnd::io::seekg_beg(f, 0);
-                    fnd::string buf;
-                    buf.resize(n);
-                    fnd::io::read(f, buf.data(), buf.size());
-                    errc err;
-                    size_t pos;
-                    fnd::tie(err, pos) = parse_config(buf, ranges);
-                    if(errc::success != err) {
-                        quit = EXIT_FAILURE;
-                        size_t nline = fnd::iterator::count(
-                            buf.begin(), buf.begin()+pos, '\n');
-                        fnd::const_cstring line{buf.begin(), buf.begin()+pos};
-                        line = {
-                            fnd::range::find(
-                                line | fnd::range::adaptor::reverse(),
-                                '\n').get(),
-                            line.end()};
-                        fnd::const_cstring line2{buf.begin()+pos, buf.end()};
-                        line2 = {
-                            line2.begin(),
-                            fnd::range::find(line2, '\n')};
+                    fnd::vector<char> path(val.begin(), val.end());
+                    path.push_back('\0');
+                    std::unique_ptr<mapped_charset> m(new mapped_charset);
+                    const errc merr = m->open(path.data());
+                    if(errc::success == merr)
+                    {
+                        ranges.insert(ranges.end(),
+                            m->ranges().begin(), m->ranges().end());
+                        compiled = std::move(m);
+                        return true;
+                    }
+                    if(errc::system_error == merr)
+                    {
+                        gl->error("Unable to open config file '", val, "': ",
+                            std::strerror(errno));
+                        quit = EXIT_FAILURE;
+                        return false;
+                    }
+                    if(errc::not_compiled != merr)
+                    {
+                        gl->error("Unable to load '", val, "'. ",
+                            fnd::system::error_code(merr).message());
+                        quit = EXIT_FAILURE;
+                        return false;
+                    }
+                    
+                    const config_error err =
+                        parse_config_file(path.data(), ranges, &tpl);
+                    if(errc::system_error == err.code)
+                    {
+                        gl->error("Unable to open config file '", val, "': ",
+                            std::strerror(errno));
+                        quit = EXIT_FAILURE;
+                        return false;
+                    }
+                    if(errc::success != err.code) {
+                        quit = EXIT_FAILURE;
                         gl->error("Error in file '", val, "' at line ",
-                            nline + 1, ": ",
-                            fnd::system::error_code(err).message(),
+                            err.position.line, ", column ",
+                            err.position.column, ": ",
+                            fnd::system::error_code(err.code).message(),
                             fmt::endl,
-                            line,
+                            err.before,
                             " ERROR --> ",
-                            line2);
+                            err.after);
                         return false;
                     }
                     return true;
                 },
                 "config", "c"),
+            fnd::opts::argument(
+                [&] (fnd::const_cstring id, fnd::const_cstring val, size_t i) {
+                    if(val.empty())
+                    {
+                        quit = EXIT_FAILURE;
+                        gl->error("Missing value. '-", id, "=???'.");
+                        return false;
+                    }
+                    compile_path.assign(val.begin(), val.end());
+                    compile_path.push_back('\0');
+                    return true;
+                },
+                "compile-config"),
+            fnd::opts::argument(
+                [&] (fnd::const_cstring id, fnd::const_cstring val, size_t i) {
+                    if(val.empty())
+                    {
+                        bench_ms = 200u;
+                        return true;
+                    }
+                    fnd::optional<unsigned> x = fmt::to_integer<unsigned>(
+                        val, 10, fnd::nothrow_tag());
+                    if(!x.valid() || 0 == x.get())
+                    {
+                        quit = EXIT_FAILURE;
+                        gl->error("Invalid number. '-",
+                            id, "=#ERROR'");
+                        return false;
+                    }
+                    bench_ms = x.get();
+                    return true;
+                },
+                "bench"),
+            fnd::opts::argument(
+                [&] (fnd::const_cstring id, fnd::const_cstring val, size_t i) {
+#ifdef RSTR_STATS
+                    if(!val.empty() && val != "json")
+                    {
+                        quit = EXIT_FAILURE;
+                        gl->error("Invalid value. '-", id, "=json'.");
+                        return false;
+                    }
+                    stats = true;
+                    stats_json = !val.empty();
+                    return true;
+#else
+                    quit = EXIT_FAILURE;
+                    gl->error("'-", id, "' isn't available, rstr was "
+                        "configured with --disable-stats.");
+                    return false;
+#endif
+                },
+                "stats"),
             
             fnd::opts::argument(
                 [&] (fnd::const_cstring id, fnd::const_cstring val, size_t i) {
@@ -714,117 +904,321 @@ int main(int argc, char **argv)
         if(quit != -1)
             return quit;
         
-        if(raw)
+#ifdef RSTR_STATS
+        if(stats)
+            enable_stats();
+        n_scope_exit() {
+            if(stats)
+                print_stats(stats_json);
+        };
+#endif
+        
+        if(0 != count && length > uint64_t(-1) / count)
+        {
+            gl->error("'--length' times '--count' is too large.");
+            return EXIT_FAILURE;
+        }
+        const uint64_t total = uint64_t(length) * count;
+        
+        if(output_path.empty() && (0 != offset || direct))
+        {
+            gl->error("'--offset' and '--direct' require '--output'.");
+            return EXIT_FAILURE;
+        }
+        if(direct && (!raw || 1 != nthreads || 0 != offset % page_size()))
+        {
+            gl->error("'--direct' requires '--raw', a single thread "
+                "and a page aligned '--offset'.");
+            return EXIT_FAILURE;
+        }
+        
+        if(!serve_path.empty() && !connect_path.empty())
+        {
+            gl->error("'--serve' and '--connect' can't be combined.");
+            return EXIT_FAILURE;
+        }
+        if(raw && (!serve_path.empty() || !connect_path.empty()))
+        {
+            gl->error("'--raw' can't be combined with '--serve' "
+                "or '--connect'.");
+            return EXIT_FAILURE;
+        }
+        if((0 != load || pool_stats) && connect_path.empty())
+        {
+            gl->error("'--load' and '--pool-stats' require '--connect'.");
+            return EXIT_FAILURE;
+        }
+        if((0 != pool_size || pool_low.valid()) && serve_path.empty())
         {
-            switch(rndmode)
+            gl->error("'--pool' and '--pool-low' require '--serve'.");
+            return EXIT_FAILURE;
+        }
+        if(pool_low.valid() && pool_low.get() > pool_size)
+        {
+            gl->error("'--pool-low' can't be larger than '--pool'.");
+            return EXIT_FAILURE;
+        }
+        if(!tpl.empty())
+        {
+            if(!ranges.empty())
             {
-            case random_mode::strong:
-                {
-                    gl->info("Using 'strong' RNG.");
-                    fnd::random::pseudo_random_device rnd;
-                    dump_raw(length, rnd);
-                }
-                break;
-            case random_mode::very_strong:
-                {
-                    gl->info("Using 'very-strong' RNG.");
-                    fnd::random::random_device rnd;
-                    dump_raw(length, rnd);
-                }
-                break;
-            case random_mode::crypt_strong:
-                {
-                    gl->info("Using 'crypt-strong' RNG.");
-                    
-                    init_crypt();
-                    
-                    ncrypt::pseudo_random_device rnd;
-                    dump_raw(length, rnd);
-                    
-                    n_scope_exit() {
-                        ncrypt::shutdown();
-                    };
-                }
-                break;
-            case random_mode::crypt_very_strong:
-                {
-                    gl->info("Using 'crypt-very-strong' RNG.");
-                    
-                    init_crypt();
-                    
-                    ncrypt::random_device rnd;
-                    dump_raw(length, rnd);
-                    
-                    n_scope_exit() {
-                        ncrypt::shutdown();
-                    };
-                }
-                break;
-            default:
-                n_throw(logic_error);
+                gl->error("A template can't be combined with other "
+                    "characters.");
+                return EXIT_FAILURE;
+            }
+            if(raw || !serve_path.empty() || !connect_path.empty()
+                || !compile_path.empty() || bench_ms.valid())
+            {
+                gl->error("A template can't be combined with '--raw', "
+                    "'--serve', '--connect', '--compile-config' "
+                    "or '--bench'.");
+                return EXIT_FAILURE;
+            }
+            gl->info("Template of ", tpl.length(), " characters in ",
+                tpl.steps().size(), " steps, using ", tpl.tables(),
+                " alphabets.");
+            if(!drains_entropy(rndmode))
+            {
+                const size_t nkernels = tpl.use_kernels();
+                if(0 != nkernels)
+                    gl->info("Using ASCII kernels for ", nkernels,
+                        " of them.");
             }
         }
-        else
+        
+        normalize_ranges(ranges, unique_chars);
+        const alphabet_info alphabet = describe_ranges(ranges);
+        if(!ranges.empty())
+        {
+            gl->info("Alphabet of ", alphabet.distinct,
+                " different characters in ", ranges.size(), " ranges.");
+            if(alphabet.size != alphabet.distinct)
+                gl->info("The alphabet holds ",
+                    alphabet.size - alphabet.distinct,
+                    " duplicates, see '--unique-chars'.");
+            gl->info("Entropy per character: ",
+                std::round(alphabet.entropy * 1000) / 1000,
+                " bits, per string: ",
+                std::round(alphabet.entropy * length * 1000) / 1000,
+                " bits.");
+        }
+        
+        if(bench_ms.valid())
+        {
+            run_bench(rndmode, ranges,
+                chrono::milliseconds(bench_ms.get()), queue_depth);
+            return EXIT_SUCCESS;
+        }
+        if(!compile_path.empty())
         {
-            auto writer = [&] (const fnd::const_cstring s) {
-                io::write(io::cout, s.data(), s.size());
-            };
+            if(ranges.empty())
+            {
+                gl->error("'--compile-config' requires an alphabet.");
+                return EXIT_FAILURE;
+            }
+            std::unique_ptr<symbol_table> own;
+            if(!compiled || compiled->ranges() != ranges)
+                own.reset(new symbol_table(ranges));
+            const errc err = save_charset(
+                own ? *own : compiled->table(), compile_path.data());
+            if(errc::success != err)
+            {
+                gl->error("Unable to write '", compile_path.data(), "': ",
+                    std::strerror(errno));
+                return EXIT_FAILURE;
+            }
+            gl->info("Saved the alphabet to '", compile_path.data(), "'.");
+            return EXIT_SUCCESS;
+        }
+        
+        if(!serve_path.empty())
+        {
+            return run_serve(serve_path.data(), rndmode, block_size, ranges,
+                delim, pool_size, pool_low.valid() ? pool_low.get()
+                    : std::max<size_t>(1, pool_size / 2));
+        }
+        if(0 != load)
+        {
+            return run_load(connect_path.data(), nthreads, load, pipeline,
+                count, length, to_config(ranges)) ?
+                EXIT_SUCCESS : EXIT_FAILURE;
+        }
+        
+        int fd = STDOUT_FILENO;
+        if(!output_path.empty())
+        {
+            fd = open_output(output_path.data(), offset, direct,
+                raw ? total : 0);
+            if(fd < 0)
+                return EXIT_FAILURE;
+        }
+        n_scope_exit() {
+            if(STDOUT_FILENO != fd)
+                ::close(fd);
+        };
+        
+        if(!connect_path.empty())
+        {
+            output_buffer out(
+                fd, output_buffer::default_capacity, queue_depth);
+            if(pool_stats)
+            {
+                if(!fetch_pool_stats(connect_path.data(), out))
+                    return EXIT_FAILURE;
+            }
+            else if(!fetch_tokens(connect_path.data(), count, length,
+                    to_config(ranges), pipeline, out))
+                return EXIT_FAILURE;
+            out.flush();
+        }
+        else if(raw)
+        {
+            // Fixed-width records, delimiters make no sense here.
+            if(1 == nthreads)
+            {
+                with_random_device(rndmode, [&] (auto &rnd) {
+                    dump_raw(fd, total, rnd, buffer_size, queue_depth);
+                });
+            }
+            else
+            {
+                output_buffer out(
+                    fd, output_buffer::default_capacity, queue_depth);
+                with_random_mode(rndmode, [&] {
+                    run_parallel(rndmode, nthreads, total, buffer_size, out,
+                        [&] (auto &rnd) {
+                            using rnd_type = std::decay_t<decltype(rnd)>;
+                            return raw_worker<rnd_type>(rnd);
+                        });
+                });
+                out.flush();
+            }
+        }
+        else if(!tpl.empty())
+        {
+            // The template has a length of its own, '--length' is ignored.
+            const bool small = count
+                <= output_buffer::default_capacity / 4 / (tpl.max_size() + 1);
+            output_buffer out(fd, output_buffer::default_capacity,
+                small ? 0 : queue_depth);
+            if(out.async())
+                gl->debug("Writing through io_uring.");
+            
+            if(1 == nthreads)
+            {
+                with_random_device(rndmode, [&] (auto &rnd) {
+                    using rnd_type = std::decay_t<decltype(rnd)>;
+                    template_worker<rnd_type> work(
+                        tpl, delim, rnd, block_size);
+                    work(0, count, out);
+                });
+            }
+            else
+            {
+                // About as many characters in a chunk as for records.
+                const uint64_t chunk_chars = 1 << 16;
+                const uint64_t chunk = tpl.length() < chunk_chars ?
+                    chunk_chars / (tpl.length() + 1) : 1;
+                
+                with_random_mode(rndmode, [&] {
+                    run_parallel(rndmode, nthreads, count, chunk, out,
+                        [&] (auto &rnd) {
+                            using rnd_type = std::decay_t<decltype(rnd)>;
+                            return template_worker<rnd_type>(
+                                tpl, delim, rnd, block_size);
+                        });
+                });
+            }
             
+            out.flush();
+        }
+        else
+        {
             if(ranges.empty())
             {
                 gl->error("No input set specified, try -AZ -az -09.");
                 return EXIT_FAILURE;
             }
             
-            switch(rndmode)
+            // The tables of a compiled config fit unless other options
+            // changed the alphabet.
+            std::unique_ptr<symbol_table> own;
+            if(!compiled || compiled->ranges() != ranges)
+                own.reset(new symbol_table(ranges));
+            else
+                gl->info("Using the tables of the compiled config.");
+            const symbol_table &tab = own ? *own : compiled->table();
+            
+            fnd::optional<ascii_kernel> kernel;
+            if(ascii_kernel::supports(tab) && !drains_entropy(rndmode))
             {
-            case random_mode::strong:
-                {
-                    gl->info("Using 'strong' RNG.");
-                    fnd::random::pseudo_random_device rnd;
-                    gen_from_ranges(ranges, length, rnd, writer);
-                }
-                break;
-            case random_mode::very_strong:
-                {
-                    gl->info("Using 'very-strong' RNG.");
-                    fnd::random::random_device rnd;
-                    gen_from_ranges(ranges, length, rnd, writer);
-                }
-                break;
-            case random_mode::crypt_strong:
-                {
-                    gl->info("Using 'crypt-strong' RNG.");
-                    
-                    init_crypt();
-                    
-                    ncrypt::pseudo_random_device rnd;
-                    gen_from_ranges(ranges, length, rnd, writer);
-                    
-                    n_scope_exit() {
-                        ncrypt::shutdown();
-                    };
-                }
-                break;
-            case random_mode::crypt_very_strong:
-                {
-                    gl->info("Using 'crypt-very-strong' RNG.");
-                    
-                    init_crypt();
-                    
-                    ncrypt::random_device rnd;
-                    gen_from_ranges(ranges, length, rnd, writer);
+                kernel = ascii_kernel(tab);
+                if(kernel.get().alphabet())
+                    gl->info("Using the ", kernel.get().name(),
+                        " ASCII kernel for ", kernel.get().alphabet(), '.');
+                else
+                    gl->info("Using the ", kernel.get().name(),
+                        " ASCII kernel.");
+            }
+            const ascii_kernel *kernel_ptr =
+                kernel.valid() ? &kernel.get() : nullptr;
+            
+            // Setting io_uring up costs more than a single write(2).
+            const bool small =
+                total + count <= output_buffer::default_capacity / 4;
+            output_buffer out(fd, output_buffer::default_capacity,
+                small ? 0 : queue_depth);
+            if(out.async())
+                gl->debug("Writing through io_uring.");
+            
+            if(0 == length)
+            {
+                for(size_t k = 0; k < count; ++k)
+                    put_delimiter(delim, out);
+            }
+            else if(1 == nthreads)
+            {
+                with_random_device(rndmode, [&] (auto &rnd) {
+                    using rnd_type = std::decay_t<decltype(rnd)>;
+                    record_worker<rnd_type> work(
+                        tab, kernel_ptr, length, delim, rnd, block_size);
+                    work(0, total, out);
                     
-                    n_scope_exit() {
-                        ncrypt::shutdown();
-                    };
-                }
-                break;
-            default:
-                n_throw(logic_error);
+                    if(0 != total && !kernel_ptr)
+                    {
+                        const index_sampler &sampler = work.sampler();
+                        gl->info("Alphabet size: ", sampler.size(),
+                            ", ", sampler.draws_per_word(),
+                            " characters per 64 bit word.");
+                        gl->info("Entropy consumed: ",
+                            double(sampler.words()) * 64.0 / double(total),
+                            " bits per character (",
+                            alphabet.entropy,
+                            " bits of entropy per character).");
+                        gl->info("Entropy read from the RNG: ",
+                            work.entropy().bytes_read(), " bytes.");
+                    }
+                });
+            }
+            else
+            {
+                // Keep whole records in a chunk unless they are huge.
+                const uint64_t chunk_chars = 1 << 16;
+                const uint64_t chunk = length < chunk_chars ?
+                    (chunk_chars / length) * length : chunk_chars;
+                
+                with_random_mode(rndmode, [&] {
+                    run_parallel(rndmode, nthreads, total, chunk, out,
+                        [&] (auto &rnd) {
+                            using rnd_type = std::decay_t<decltype(rnd)>;
+                            return record_worker<rnd_type>(
+                                tab, kernel_ptr, length, delim, rnd,
+                                block_size);
+                        });
+                });
             }
             
-            fmt::fwrite(io::cout, fmt::endl);
+            out.flush();
         }
     }
     catch(...)
@@ -0,0 +1,384 @@
+/*--!>
+This file is part of 'rstr', a simple random string generator written in C++.
+
+Copyright 2016 outshined (outshined@riseup.net)
+    (PGP: 0x8A80C12396A4836F82A93FA79CA3D0F7E8FBCED6)
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, either version 3 of the
+License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+--------------------------------------------------------------------------<!--*/
+#include "output.h"
+
+#include <cerrno>
+#include <cstring>
+
+#include <sys/mman.h>
+
+#ifdef HAVE_LINUX_IO_URING_H
+#   include <linux/io_uring.h>
+#   include <sys/syscall.h>
+#endif
+
+//------------------------------------------------------------------------------
+void write_all(const int fd, const char *s, size_t n)
+{
+    RSTR_STAGE(output, n);
+    while(0 != n)
+    {
+        const ssize_t r = ::write(fd, s, n);
+        if(r < 0)
+        {
+            if(EINTR == errno)
+                continue;
+            n_throw(runtime_error);
+        }
+        s += r;
+        n -= r;
+    }
+}
+
+//------------------------------------------------------------------------------
+std::unique_ptr<async_writer> async_writer::create(
+    const int fd, const unsigned depth)
+{
+    if(0 == depth)
+        return nullptr;
+#ifdef HAVE_LINUX_IO_URING_H
+    std::unique_ptr<async_writer> w(new async_writer(fd));
+    if(!w->setup(depth))
+        return nullptr;
+    return w;
+#else
+    return nullptr;
+#endif
+}
+//------------------------------------------------------------------------------
+async_writer::~async_writer()
+{
+#ifdef HAVE_LINUX_IO_URING_H
+    if(sqes_)
+        ::munmap(sqes_, sqes_size_);
+    if(ring_)
+        ::munmap(ring_, ring_size_);
+    if(ring_fd_ >= 0)
+        ::close(ring_fd_);
+#endif
+}
+//------------------------------------------------------------------------------
+void async_writer::write(
+    const char *p, const size_t n, const uint64_t tag)
+{
+    if(in_flight_ == depth())
+        n_throw(logic_error);
+    RSTR_STAGE(output, n);
+    
+    size_t k = 0;
+    while(entries_[k].busy)
+        ++k;
+    entry &e = entries_[k];
+    e.busy = true;
+    e.p = p;
+    e.n = n;
+    e.offset = offset_;
+    e.tag = tag;
+    if(seekable_)
+        offset_ += n;
+    ++in_flight_;
+    
+    submit(k);
+}
+//------------------------------------------------------------------------------
+uint64_t async_writer::reap()
+{
+    if(0 == in_flight_)
+        n_throw(logic_error);
+    RSTR_STAGE(output, 0);
+    
+    while(true)
+    {
+        size_t k = 0;
+        const int res = wait(k);
+        entry &e = entries_[k];
+        
+        if(res < 0)
+        {
+            if(-EINTR == res || -EAGAIN == res)
+            {
+                submit(k);
+                continue;
+            }
+            errno = -res;
+            n_throw(runtime_error);
+        }
+        
+        // Short write, queue the rest at once.
+        e.p += res;
+        e.n -= size_t(res);
+        if(seekable_)
+            e.offset += uint64_t(res);
+        if(0 != e.n)
+        {
+            submit(k);
+            continue;
+        }
+        
+        e.busy = false;
+        --in_flight_;
+        return e.tag;
+    }
+}
+//------------------------------------------------------------------------------
+void async_writer::drain()
+{
+    while(0 != in_flight_)
+        reap();
+    if(seekable_)
+        ::lseek(fd_, off_t(offset_), SEEK_SET);
+}
+
+#ifdef HAVE_LINUX_IO_URING_H
+//------------------------------------------------------------------------------
+bool async_writer::setup(unsigned depth)
+{
+    struct stat st;
+    if(0 != ::fstat(fd_, &st))
+        return false;
+    // O_APPEND ignores the offsets and appends in the order the writes
+    // complete, so like a pipe it can only take one at a time.
+    const int flags = ::fcntl(fd_, F_GETFL);
+    if(flags < 0)
+        return false;
+    if(!(flags & O_APPEND)
+        && (S_ISREG(st.st_mode) || S_ISBLK(st.st_mode)))
+    {
+        const off_t pos = ::lseek(fd_, 0, SEEK_CUR);
+        if(pos < 0)
+            return false;
+        seekable_ = true;
+        offset_ = uint64_t(pos);
+    }
+    else
+        depth = 1;
+    
+    struct io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    ring_fd_ = int(::syscall(__NR_io_uring_setup, depth, &params));
+    if(ring_fd_ < 0)
+        return false;
+    
+    // IORING_OP_WRITE needs Linux 5.6, ask the kernel whether it's
+    // there.
+    {
+        const size_t nops = IORING_OP_WRITE + 1;
+        fnd::vector<char> mem(sizeof(io_uring_probe)
+            + nops * sizeof(io_uring_probe_op), 0);
+        io_uring_probe *probe =
+            reinterpret_cast<io_uring_probe *>(mem.data());
+        if(0 != ::syscall(__NR_io_uring_register, ring_fd_,
+                IORING_REGISTER_PROBE, probe, unsigned(nops))
+            || probe->last_op < IORING_OP_WRITE
+            || !(probe->ops[IORING_OP_WRITE].flags
+                & IO_URING_OP_SUPPORTED))
+            return false;
+    }
+    
+    const size_t sq_size =
+        params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    const size_t cq_size =
+        params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if(!(params.features & IORING_FEAT_SINGLE_MMAP))
+        return false; // Linux < 5.4 doesn't have IORING_OP_WRITE anyway
+    ring_size_ = sq_size > cq_size ? sq_size : cq_size;
+    void *ring = ::mmap(nullptr, ring_size_, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+    if(MAP_FAILED == ring)
+        return false;
+    ring_ = static_cast<char *>(ring);
+    
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    void *sqes = ::mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+    if(MAP_FAILED == sqes)
+        return false;
+    sqes_ = static_cast<io_uring_sqe *>(sqes);
+    
+    sq_tail_ = reinterpret_cast<unsigned *>(ring_ + params.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<unsigned *>(
+        ring_ + params.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned *>(
+        ring_ + params.sq_off.array);
+    cq_head_ = reinterpret_cast<unsigned *>(ring_ + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned *>(ring_ + params.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned *>(
+        ring_ + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe *>(ring_ + params.cq_off.cqes);
+    
+    entries_.resize(depth);
+    return true;
+}
+//------------------------------------------------------------------------------
+void async_writer::submit(const size_t k)
+{
+    const entry &e = entries_[k];
+    const unsigned tail = *sq_tail_;
+    const unsigned i = tail & sq_mask_;
+    io_uring_sqe &sqe = sqes_[i];
+    std::memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_WRITE;
+    sqe.fd = fd_;
+    sqe.off = seekable_ ? e.offset : uint64_t(-1);
+    sqe.addr = reinterpret_cast<uint64_t>(e.p);
+    sqe.len = e.n > (1u << 30) ? (1u << 30) : unsigned(e.n);
+    sqe.user_data = k;
+    sq_array_[i] = i;
+    __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+    
+    while(::syscall(__NR_io_uring_enter, ring_fd_, 1, 0, 0, nullptr, 0)
+        < 0)
+    {
+        if(EINTR != errno && EAGAIN != errno && EBUSY != errno)
+            n_throw(runtime_error);
+    }
+}
+//------------------------------------------------------------------------------
+int async_writer::wait(size_t &k)
+{
+    while(true)
+    {
+        const unsigned head = *cq_head_;
+        if(head != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE))
+        {
+            const io_uring_cqe &cqe = cqes_[head & cq_mask_];
+            k = size_t(cqe.user_data);
+            const int res = cqe.res;
+            __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+            return res;
+        }
+        if(::syscall(__NR_io_uring_enter, ring_fd_, 0, 1,
+                IORING_ENTER_GETEVENTS, nullptr, 0) < 0
+            && EINTR != errno)
+            n_throw(runtime_error);
+    }
+}
+#else
+//------------------------------------------------------------------------------
+bool async_writer::setup(unsigned)
+{
+    return false;
+}
+//------------------------------------------------------------------------------
+void async_writer::submit(size_t)
+{
+    n_throw(logic_error);
+}
+//------------------------------------------------------------------------------
+int async_writer::wait(size_t &)
+{
+    n_throw(logic_error);
+}
+#endif
+
+//------------------------------------------------------------------------------
+page_buffer::page_buffer(const size_t n)
+: size_(n)
+{
+    if(0 == n)
+        n_throw(logic_error);
+    void *p = ::mmap(nullptr, n, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(MAP_FAILED == p)
+        n_throw(runtime_error);
+    data_ = static_cast<char *>(p);
+#ifdef MADV_HUGEPAGE
+    if(n >= (size_t(2) << 20))
+        ::madvise(data_, n, MADV_HUGEPAGE); // just a hint
+#endif
+}
+//------------------------------------------------------------------------------
+page_buffer::~page_buffer()
+{
+    if(wipe_)
+        secure_zero(data_, size_);
+    ::munmap(data_, size_);
+}
+
+//------------------------------------------------------------------------------
+size_t page_size() noexcept
+{
+    const long r = ::sysconf(_SC_PAGESIZE);
+    return r > 0 ? size_t(r) : 4096;
+}
+
+//------------------------------------------------------------------------------
+int open_output(
+    const char *path,
+    const uint64_t offset,
+    const bool direct,
+    const uint64_t prealloc)
+{
+    int flags = O_WRONLY | O_CREAT;
+#ifdef O_DIRECT
+    if(direct)
+        flags |= O_DIRECT;
+#else
+    if(direct)
+    {
+        gl->error("O_DIRECT is not supported on this system.");
+        return -1;
+    }
+#endif
+    
+    const int fd = ::open(path, flags, 0666);
+    if(fd < 0)
+    {
+        gl->error("Unable to open '", path, "' for writing: ",
+            std::strerror(errno));
+        return -1;
+    }
+    
+    struct stat st;
+    if(0 != ::fstat(fd, &st))
+    {
+        gl->error("Unable to stat '", path, "': ", std::strerror(errno));
+        ::close(fd);
+        return -1;
+    }
+    
+    if(S_ISREG(st.st_mode))
+    {
+        if(0 == offset && 0 != ::ftruncate(fd, 0))
+        {
+            gl->error("Unable to truncate '", path, "': ",
+                std::strerror(errno));
+            ::close(fd);
+            return -1;
+        }
+#ifdef __linux__
+        if(0 != prealloc
+            && 0 != ::fallocate(fd, 0, off_t(offset), off_t(prealloc)))
+        {
+            gl->debug("fallocate() failed: ", std::strerror(errno));
+        }
+#endif
+    }
+    
+    if(0 != offset && off_t(-1) == ::lseek(fd, off_t(offset), SEEK_SET))
+    {
+        gl->error("Unable to seek to ", offset, " in '", path, "': ",
+            std::strerror(errno));
+        ::close(fd);
+        return -1;
+    }
+    
+    return fd;
+}
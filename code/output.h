@@ -0,0 +1,605 @@
+/*--!>
+This file is part of 'rstr', a simple random string generator written in C++.
+
+Copyright 2016 outshined (outshined@riseup.net)
+    (PGP: 0x8A80C12396A4836F82A93FA79CA3D0F7E8FBCED6)
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, either version 3 of the
+License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+--------------------------------------------------------------------------<!--*/
+#ifndef RSTR_OUTPUT_H
+#define RSTR_OUTPUT_H
+
+#include "log.h"
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#ifdef HAVE_LINUX_IO_URING_H
+struct io_uring_sqe;
+struct io_uring_cqe;
+#endif
+
+//------------------------------------------------------------------------------
+/** Calls write(2) until all of @p s is written.
+ */
+void write_all(const int fd, const char *s, size_t n);
+
+//------------------------------------------------------------------------------
+/** Writes buffers in the background using io_uring, keeping up to depth()
+ * of them in flight.
+ *
+ * Writes land in the order they were queued: files and block devices get
+ * explicit offsets, so several writes can run at once. Anything else (like
+ * a pipe or a file opened with O_APPEND) is limited to one write at a time,
+ * which still lets the caller go on generating while the write is under
+ * way.
+ *
+ * Talks to the kernel directly, there is no dependency on liburing.
+ */
+class async_writer
+{
+public:
+    /** @return Null if io_uring isn't available, in which case the caller
+     *  should just use write(2).
+     */
+    static std::unique_ptr<async_writer> create(
+        const int fd, const unsigned depth);
+    
+    async_writer(const async_writer &) = delete;
+    async_writer &operator=(const async_writer &) = delete;
+    
+    ~async_writer();
+    
+    inline unsigned depth() const noexcept {
+        return unsigned(entries_.size());
+    }
+    inline unsigned in_flight() const noexcept {
+        return in_flight_;
+    }
+    
+    /** Queues [p, p + n) to be written after everything queued before.
+     * The memory must stay untouched until @p tag is returned by reap().
+     * There must be less than depth() writes in flight.
+     */
+    void write(const char *p, const size_t n, const uint64_t tag);
+    
+    /** Waits until one of the writes has been completed.
+     * @return The tag passed to write().
+     */
+    uint64_t reap();
+    
+    /** Waits for all writes.
+     */
+    void drain();
+    
+private:
+    struct entry
+    {
+        bool busy = false;
+        const char *p = nullptr;
+        size_t n = 0;
+        uint64_t offset = 0;
+        uint64_t tag = 0;
+    };
+    
+    explicit async_writer(const int fd)
+    : fd_(fd)
+    {}
+    
+    bool setup(unsigned depth);
+    void submit(const size_t k);
+    int wait(size_t &k);
+    
+    int fd_;
+    bool seekable_ = false;
+    uint64_t offset_ = 0;
+    unsigned in_flight_ = 0;
+    fnd::vector<entry> entries_;
+#ifdef HAVE_LINUX_IO_URING_H
+    int ring_fd_ = -1;
+    char *ring_ = nullptr;
+    size_t ring_size_ = 0;
+    io_uring_sqe *sqes_ = nullptr;
+    size_t sqes_size_ = 0;
+    unsigned *sq_tail_ = nullptr;
+    unsigned sq_mask_ = 0;
+    unsigned *sq_array_ = nullptr;
+    unsigned *cq_head_ = nullptr;
+    unsigned *cq_tail_ = nullptr;
+    unsigned cq_mask_ = 0;
+    io_uring_cqe *cqes_ = nullptr;
+#endif
+};
+
+//------------------------------------------------------------------------------
+/** Collects output in a reusable buffer and hands it to write(2) in large
+ * chunks, instead of paying for one library call per character.
+ *
+ * With an async_writer, full buffers are written in the background while
+ * the next one is being filled.
+ */
+class output_buffer
+{
+public:
+    static constexpr size_t default_capacity = 64 * 1024;
+    
+    /** @param queue_depth The number of buffers in flight if io_uring is
+     *  available, 0 to always use write(2).
+     */
+    explicit output_buffer(
+        const int fd = STDOUT_FILENO,
+        const size_t capacity = default_capacity,
+        const unsigned queue_depth = 0)
+    : fd_(fd), async_(async_writer::create(fd, queue_depth))
+    {
+        if(0 == capacity)
+            n_throw(logic_error);
+        
+        const size_t nbufs = async_ ? async_->depth() + 1 : 1;
+        for(size_t i = 0; i < nbufs; ++i)
+        {
+            bufs_.emplace_back();
+            bufs_.back().resize(capacity);
+        }
+        for(size_t i = 1; i < nbufs; ++i)
+            free_.push_back(i);
+    }
+    
+    output_buffer(const output_buffer &) = delete;
+    output_buffer &operator=(const output_buffer &) = delete;
+    
+    ~output_buffer()
+    {
+        if(async_)
+        {
+            // The kernel must be done with the buffers before they go.
+            try {
+                while(0 != async_->in_flight())
+                    async_->reap();
+            } catch(...) {}
+        }
+    }
+    
+    /** @return True if io_uring is used.
+     */
+    inline bool async() const noexcept {
+        return bool(async_);
+    }
+    
+    inline void write(const char *s, size_t n)
+    {
+        if(n > capacity() - pos_)
+        {
+            if(!async_)
+            {
+                flush();
+                if(n > capacity())
+                {
+                    write_all(s, n);
+                    return;
+                }
+            }
+            else
+            {
+                // Keep everything in order by going through the buffers.
+                while(n > capacity() - pos_)
+                {
+                    const size_t m = capacity() - pos_;
+                    std::memcpy(buf().data() + pos_, s, m);
+                    pos_ += m;
+                    s += m;
+                    n -= m;
+                    submit();
+                }
+            }
+        }
+        std::memcpy(buf().data() + pos_, s, n);
+        pos_ += n;
+    }
+    inline void write(const fnd::const_cstring s) {
+        write(s.data(), s.size());
+    }
+    /** @return A pointer to at least @p n bytes, at most capacity(), which
+     *  become part of the output by a following call to commit().
+     */
+    inline char *reserve(const size_t n)
+    {
+        if(n > capacity())
+            n_throw(logic_error);
+        if(n > capacity() - pos_)
+            submit();
+        return buf().data() + pos_;
+    }
+    inline void commit(const size_t n) noexcept {
+        pos_ += n;
+    }
+    
+    inline void put(const char c)
+    {
+        if(capacity() == pos_)
+            submit();
+        buf()[pos_++] = c;
+    }
+    
+    inline size_t capacity() const noexcept {
+        return bufs_[cur_].size();
+    }
+    
+    /** Writes everything and waits until it's done.
+     */
+    inline void flush()
+    {
+        submit();
+        if(async_)
+        {
+            while(0 != async_->in_flight())
+                free_.push_back(size_t(async_->reap()));
+            async_->drain();
+        }
+    }
+    
+private:
+    inline fnd::vector<char> &buf() noexcept {
+        return bufs_[cur_];
+    }
+    
+    /** Starts writing the current buffer and switches to a free one.
+     */
+    inline void submit()
+    {
+        if(0 == pos_)
+            return;
+        if(!async_)
+        {
+            write_all(buf().data(), pos_);
+            pos_ = 0;
+            return;
+        }
+        
+        if(free_.empty())
+            free_.push_back(size_t(async_->reap()));
+        async_->write(buf().data(), pos_, cur_);
+        cur_ = free_.back();
+        free_.pop_back();
+        pos_ = 0;
+    }
+    
+    inline void write_all(const char *s, const size_t n) {
+        ::write_all(fd_, s, n);
+    }
+    
+    int fd_;
+    std::unique_ptr<async_writer> async_;
+    fnd::vector<fnd::vector<char>> bufs_;
+    fnd::vector<size_t> free_;
+    size_t cur_ = 0;
+    size_t pos_ = 0;
+};
+
+//------------------------------------------------------------------------------
+/** A growable buffer with the reserve()/commit() interface of output_buffer,
+ * holding a piece of output that gets written later on as a whole.
+ */
+class chunk_buffer
+{
+public:
+    chunk_buffer() = default;
+    chunk_buffer(const chunk_buffer &) = delete;
+    chunk_buffer &operator=(const chunk_buffer &) = delete;
+    
+    ~chunk_buffer()
+    {
+        secure_zero(buf_.data(), buf_.size());
+    }
+    
+    inline char *reserve(const size_t n)
+    {
+        if(n > buf_.size() - pos_)
+            buf_.resize(pos_ + n);
+        return buf_.data() + pos_;
+    }
+    inline void commit(const size_t n) noexcept {
+        pos_ += n;
+    }
+    inline void put(const char c)
+    {
+        *reserve(1) = c;
+        commit(1);
+    }
+    
+    inline void clear() noexcept {
+        pos_ = 0;
+    }
+    /** Like clear() but overwrites the contents first.
+     */
+    inline void wipe() noexcept
+    {
+        secure_zero(buf_.data(), pos_);
+        pos_ = 0;
+    }
+    inline const char *data() const noexcept {
+        return buf_.data();
+    }
+    inline size_t size() const noexcept {
+        return pos_;
+    }
+    
+private:
+    fnd::vector<char> buf_;
+    size_t pos_ = 0;
+};
+
+//------------------------------------------------------------------------------
+/** A page aligned buffer straight from mmap(), backed by huge pages if the
+ * kernel agrees.
+ */
+class page_buffer
+{
+public:
+    explicit page_buffer(const size_t n);
+    page_buffer(const page_buffer &) = delete;
+    page_buffer &operator=(const page_buffer &) = delete;
+    
+    ~page_buffer();
+    
+    /** Don't wipe the pages on destruction, because someone else (like a
+     * pipe) might still be looking at them.
+     */
+    inline void keep_contents() noexcept {
+        wipe_ = false;
+    }
+    
+    inline char *data() const noexcept {
+        return data_;
+    }
+    inline size_t size() const noexcept {
+        return size_;
+    }
+    
+private:
+    char *data_;
+    size_t size_;
+    bool wipe_ = true;
+};
+
+//------------------------------------------------------------------------------
+size_t page_size() noexcept;
+
+//------------------------------------------------------------------------------
+/** Writes @p length bytes from @p rnd to @p fd, in pieces of
+ * @p buffer_size bytes.
+ *
+ * A second thread fills a ring of page aligned buffers while the calling
+ * thread writes them out. If @p fd is a pipe, the buffers are handed to
+ * the kernel with vmsplice() instead of being copied. The pipe then
+ * refers to our pages, so a buffer is only refilled after at least a pipe's
+ * capacity of data has been pushed behind it.
+ *
+ * Otherwise up to @p queue_depth buffers are written in the background
+ * with io_uring if available, or one after the other with write(2).
+ *
+ * If @p fd was opened with O_DIRECT, O_DIRECT is switched off for the last
+ * write if that isn't a multiple of the page size.
+ */
+template <class Rnd>
+inline void dump_raw(
+    const int fd,
+    const uint64_t length,
+    Rnd &rnd,
+    size_t buffer_size,
+    const unsigned queue_depth)
+{
+    if(0 == length)
+        return;
+    
+    const size_t pagesz = page_size();
+    buffer_size = (buffer_size + pagesz - 1) / pagesz * pagesz;
+    if(buffer_size > length)
+        buffer_size = size_t((length + pagesz - 1) / pagesz * pagesz);
+    
+    bool splice = false;
+    size_t lag = 1; // buffers written before the oldest one may be reused
+#if defined(__linux__) && defined(F_GETPIPE_SZ)
+    {
+        struct stat st;
+        if(0 == ::fstat(fd, &st) && S_ISFIFO(st.st_mode))
+        {
+            ::fcntl(fd, F_SETPIPE_SZ, int(buffer_size));
+            const int n = ::fcntl(fd, F_GETPIPE_SZ);
+            if(n > 0)
+            {
+                splice = true;
+                lag = (size_t(n) + buffer_size - 1) / buffer_size;
+            }
+        }
+    }
+#endif
+    std::unique_ptr<async_writer> async;
+    if(!splice && length > buffer_size) // not worth it for a single write
+        async = async_writer::create(fd, queue_depth);
+    
+    gl->debug("Raw output: ", buffer_size, " byte buffers, ",
+        splice ? "vmsplice()." : async ? "io_uring." : "write().");
+    
+    struct slot
+    {
+        explicit slot(const size_t n) : buf(n) {}
+        
+        page_buffer buf;
+        size_t size = 0;
+        bool full = false;
+    };
+    const size_t nslots = async ? async->depth() + 2 : lag + 2;
+    fnd::vector<std::unique_ptr<slot>> ring;
+    for(size_t i = 0; i < nslots; ++i)
+    {
+        ring.emplace_back(new slot(buffer_size));
+        if(splice)
+            ring.back()->buf.keep_contents();
+    }
+    const uint64_t nbufs = (length + buffer_size - 1) / buffer_size;
+    
+    std::mutex m;
+    std::condition_variable cv;
+    bool abort = false;
+    fnd::exception_ptr error;
+    
+    std::thread filler([&] {
+        try {
+            for(uint64_t j = 0; j < nbufs; ++j)
+            {
+                slot &sl = *ring[j % nslots];
+                {
+                    std::unique_lock<std::mutex> lock(m);
+                    cv.wait(lock, [&] { return !sl.full || abort; });
+                    if(abort)
+                        return;
+                }
+                const uint64_t first = j * buffer_size;
+                sl.size = size_t(length - first < buffer_size ?
+                    length - first : buffer_size);
+                read_random(rnd, sl.buf.data(), sl.size);
+                {
+                    std::lock_guard<std::mutex> lock(m);
+                    sl.full = true;
+                }
+                cv.notify_all();
+            }
+        }
+        catch(...) {
+            std::lock_guard<std::mutex> lock(m);
+            error = fnd::current_exception();
+            abort = true;
+            cv.notify_all();
+        }
+    });
+    
+    auto release = [&] (slot &sl) {
+        {
+            std::lock_guard<std::mutex> lock(m);
+            sl.full = false;
+        }
+        cv.notify_all();
+    };
+    
+    try {
+        for(uint64_t j = 0; j < nbufs; ++j)
+        {
+            slot &sl = *ring[j % nslots];
+            {
+                std::unique_lock<std::mutex> lock(m);
+                cv.wait(lock, [&] { return sl.full || abort; });
+                if(abort)
+                    break;
+            }
+            
+            if(!splice)
+            {
+#ifdef O_DIRECT
+                if(0 != sl.size % pagesz)
+                {
+                    if(async)
+                    {
+                        while(0 != async->in_flight())
+                            release(*ring[async->reap()]);
+                    }
+                    const int flags = ::fcntl(fd, F_GETFL);
+                    if(flags >= 0 && (flags & O_DIRECT))
+                        ::fcntl(fd, F_SETFL, flags & ~O_DIRECT);
+                }
+#endif
+                if(async)
+                {
+                    if(async->in_flight() == async->depth())
+                        release(*ring[async->reap()]);
+                    async->write(sl.buf.data(), sl.size, j % nslots);
+                }
+                else
+                {
+                    write_all(fd, sl.buf.data(), sl.size);
+                    release(sl);
+                }
+                continue;
+            }
+#if defined(__linux__) && defined(F_GETPIPE_SZ)
+            RSTR_STAGE(output, sl.size);
+            struct iovec iov;
+            iov.iov_base = sl.buf.data();
+            iov.iov_len = sl.size;
+            while(0 != iov.iov_len)
+            {
+                const ssize_t r = ::vmsplice(fd, &iov, 1, 0);
+                if(r < 0)
+                {
+                    if(EINTR == errno)
+                        continue;
+                    n_throw(runtime_error);
+                }
+                iov.iov_base = static_cast<char *>(iov.iov_base) + r;
+                iov.iov_len -= r;
+            }
+            if(j >= lag)
+                release(*ring[(j - lag) % nslots]);
+#endif
+        }
+    }
+    catch(...) {
+        {
+            std::lock_guard<std::mutex> lock(m);
+            abort = true;
+        }
+        cv.notify_all();
+        filler.join();
+        if(async)
+        {
+            try {
+                while(0 != async->in_flight())
+                    async->reap();
+            } catch(...) {}
+        }
+        throw;
+    }
+    
+    filler.join();
+    if(async)
+    {
+        while(0 != async->in_flight())
+            async->reap();
+        async->drain();
+    }
+    if(error)
+        std::rethrow_exception(error);
+}
+
+//------------------------------------------------------------------------------
+/** Opens the file or block device given by --output and moves to
+ * @p offset. Regular files are truncated unless an offset is given, just
+ * like a shell redirection would, and @p prealloc bytes get allocated
+ * up front.
+ * @return The file descriptor or -1 after logging the error.
+ */
+int open_output(
+    const char *path,
+    const uint64_t offset,
+    const bool direct,
+    const uint64_t prealloc);
+
+#endif // RSTR_OUTPUT_H
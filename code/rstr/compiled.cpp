@@ -0,0 +1,337 @@
+/*--!>
+This file is part of 'rstr', a simple random string generator written in C++.
+
+Copyright 2016 outshined (outshined@riseup.net)
+    (PGP: 0x8A80C12396A4836F82A93FA79CA3D0F7E8FBCED6)
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, either version 3 of the
+License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+--------------------------------------------------------------------------<!--*/
+#include "core.h"
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdlib>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+//------------------------------------------------------------------------------
+/** The layout of a compiled config, all in native byte order:
+ *
+ * header
+ * offsets  (nranges + 1) * uint64_t
+ * first    nranges * char32_t
+ * ascii    nchars * char                 if flags == flat_ascii
+ * utf8     nchars * encoded_char         if flags == flat_utf8
+ * guide    nguide * uint32_t             otherwise
+ *
+ * Every section starts at a multiple of 8 bytes, the padding is zero.
+ */
+struct file_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t size;
+    uint64_t checksum;
+    uint64_t nranges;
+    uint64_t nchars;
+    uint64_t nguide;
+    uint32_t shift;
+    uint32_t flags;
+};
+
+static_assert(sizeof(file_header) == 64, "Unexpected padding.");
+
+constexpr char file_magic[8] = {'r', 's', 't', 'r', '-', 'c', 's', 0};
+constexpr uint32_t native_byte_order = 0x01020304;
+constexpr uint32_t flat_ascii = 1;
+constexpr uint32_t flat_utf8 = 2;
+
+//------------------------------------------------------------------------------
+inline uint64_t padded(const uint64_t n) noexcept {
+    return (n + 7) & ~uint64_t(7);
+}
+//------------------------------------------------------------------------------
+/** FNV-1a over 64 bit words, with the checksum field taken as zero.
+ * @param size A multiple of 8.
+ */
+inline uint64_t checksum(const char *p, const size_t size) noexcept
+{
+    uint64_t h = 0xcbf29ce484222325ull;
+    for(size_t i = 0; i < size; i += 8)
+    {
+        uint64_t w;
+        std::memcpy(&w, p + i, 8);
+        if(offsetof(file_header, checksum) == i)
+            w = 0;
+        h = (h ^ w) * 0x100000001b3ull;
+    }
+    return h;
+}
+
+} // anonymous
+
+//------------------------------------------------------------------------------
+errc save_charset(const symbol_table &tab, const char *path)
+{
+    file_header h;
+    std::memset(&h, 0, sizeof(h));
+    std::memcpy(h.magic, file_magic, sizeof(h.magic));
+    h.version = mapped_charset::version;
+    h.byte_order = native_byte_order;
+    h.nranges = tab.nranges_;
+    h.nchars = tab.size();
+    h.nguide = tab.nguide_;
+    h.shift = uint32_t(tab.shift_);
+    h.flags = tab.ascii_ ? flat_ascii : tab.utf8_ ? flat_utf8 : 0;
+    
+    fnd::vector<char> buf;
+    const auto append = [&buf] (const void *p, const size_t n) {
+        const char *c = static_cast<const char *>(p);
+        buf.insert(buf.end(), c, c + n);
+        buf.resize(padded(buf.size()), 0);
+    };
+    append(&h, sizeof(h));
+    append(tab.offsets_, (h.nranges + 1) * sizeof(uint64_t));
+    append(tab.first_, h.nranges * sizeof(char32_t));
+    if(flat_ascii == h.flags)
+        append(tab.ascii_, h.nchars);
+    else if(flat_utf8 == h.flags)
+        append(tab.utf8_, h.nchars * sizeof(symbol_table::encoded_char));
+    else
+        append(tab.guide_, h.nguide * sizeof(uint32_t));
+    
+    h.size = buf.size();
+    std::memcpy(buf.data(), &h, sizeof(h));
+    h.checksum = checksum(buf.data(), buf.size());
+    std::memcpy(buf.data(), &h, sizeof(h));
+    
+    // Written next to the file and renamed over it, so that a process
+    // which has the old one mapped keeps reading the old one instead of
+    // getting SIGBUS or half of the new one.
+    fnd::vector<char> tmp(path, path + std::strlen(path));
+    const char suffix[] = ".XXXXXX";
+    tmp.insert(tmp.end(), suffix, suffix + sizeof(suffix));
+    const int fd = ::mkstemp(tmp.data());
+    if(fd < 0)
+        return errc::system_error;
+    bool done = false;
+    n_scope_exit() {
+        if(!done)
+        {
+            const int e = errno;
+            ::close(fd);
+            ::unlink(tmp.data());
+            errno = e;
+        }
+    };
+    
+    const char *p = buf.data();
+    size_t left = buf.size();
+    while(0 != left)
+    {
+        const ssize_t res = ::write(fd, p, left);
+        if(res < 0)
+        {
+            if(EINTR == errno)
+                continue;
+            return errc::system_error;
+        }
+        p += res;
+        left -= size_t(res);
+    }
+    
+    if(0 != ::fchmod(fd, 0644) || 0 != ::fsync(fd))
+        return errc::system_error;
+    done = true;
+    if(0 != ::close(fd) || 0 != ::rename(tmp.data(), path))
+    {
+        const int e = errno;
+        ::unlink(tmp.data());
+        errno = e;
+        return errc::system_error;
+    }
+    return errc::success;
+}
+
+//------------------------------------------------------------------------------
+mapped_charset::~mapped_charset()
+{
+    if(map_)
+        ::munmap(map_, size_);
+}
+//------------------------------------------------------------------------------
+errc mapped_charset::open(const char *path)
+{
+    if(map_)
+        n_throw(logic_error);
+    
+    const int fd = ::open(path, O_RDONLY);
+    if(fd < 0)
+        return errc::system_error;
+    n_scope_exit() {
+        ::close(fd);
+    };
+    
+    struct stat st;
+    if(0 != ::fstat(fd, &st))
+        return errc::system_error;
+    if(!S_ISREG(st.st_mode) || size_t(st.st_size) < sizeof(file_header))
+        return errc::not_compiled;
+    
+    file_header h;
+    if(ssize_t(sizeof(h)) != ::pread(fd, &h, sizeof(h), 0)
+        || 0 != std::memcmp(h.magic, file_magic, sizeof(h.magic)))
+        return errc::not_compiled;
+    if(version != h.version || native_byte_order != h.byte_order)
+        return errc::unsupported_compiled;
+    
+    // Bounds every count by the file size before computing the layout.
+    const uint64_t size = uint64_t(st.st_size);
+    if(h.size != size || 0 != size % 8
+        || 0 == h.nranges || h.nranges > size
+        || 0 == h.nchars
+        || h.nguide > size
+        || h.shift >= 64)
+        return errc::corrupt_compiled;
+    
+    const uint64_t offsets_at = sizeof(file_header);
+    const uint64_t first_at =
+        offsets_at + padded((h.nranges + 1) * sizeof(uint64_t));
+    const uint64_t table_at =
+        first_at + padded(h.nranges * sizeof(char32_t));
+    uint64_t end = table_at;
+    if(flat_ascii == h.flags || flat_utf8 == h.flags)
+    {
+        if(h.nchars > symbol_table::max_flat_size || 0 != h.nguide)
+            return errc::corrupt_compiled;
+        end += padded(h.nchars * (flat_ascii == h.flags ?
+            1 : sizeof(symbol_table::encoded_char)));
+    }
+    else if(0 == h.flags)
+    {
+        if(h.nchars <= symbol_table::max_flat_size
+            || ((h.nchars - 1) >> h.shift) + 1 != h.nguide)
+            return errc::corrupt_compiled;
+        end += padded(h.nguide * sizeof(uint32_t));
+    }
+    else
+        return errc::corrupt_compiled;
+    if(end != size)
+        return errc::corrupt_compiled;
+    
+    // Kept to itself until everything checks out, so that a failed open()
+    // leaves nothing behind and can be retried.
+    void *m = ::mmap(nullptr, size_t(size), PROT_READ, MAP_PRIVATE, fd, 0);
+    if(MAP_FAILED == m)
+        return errc::system_error;
+    bool keep = false;
+    n_scope_exit() {
+        if(!keep)
+            ::munmap(m, size_t(size));
+    };
+    const char *base = static_cast<const char *>(m);
+    
+    if(checksum(base, size_t(size)) != h.checksum)
+        return errc::corrupt_compiled;
+    
+    // The checksum only catches accidents, anyone can compute it for a
+    // crafted file. So the tables have to be sound for the lookups not to
+    // read out of bounds, and have to agree with the ranges, which for the
+    // flat tables means checking every entry: an ASCII kernel built from
+    // a byte >= 0x80 would write out of bounds.
+    const uint64_t *offsets =
+        reinterpret_cast<const uint64_t *>(base + offsets_at);
+    const char32_t *first =
+        reinterpret_cast<const char32_t *>(base + first_at);
+    if(0 != offsets[0] || h.nchars != offsets[h.nranges])
+        return errc::corrupt_compiled;
+    for(uint64_t k = 0; k < h.nranges; ++k)
+    {
+        // Like parse_config(), no surrogates and nothing above U+10FFFF.
+        const uint64_t beg = first[k];
+        if(offsets[k] >= offsets[k+1] || beg > 0x10FFFF
+            || offsets[k+1] - offsets[k] > 0x110000 - beg)
+            return errc::corrupt_compiled;
+        const uint64_t end = beg + (offsets[k+1] - offsets[k]);
+        if(beg < 0xE000 && end > 0xD800)
+            return errc::corrupt_compiled;
+        if(flat_ascii == h.flags && end > 0x80)
+            return errc::corrupt_compiled;
+    }
+    
+    const char *ascii = nullptr;
+    const symbol_table::encoded_char *utf8 = nullptr;
+    const uint32_t *guide = nullptr;
+    if(flat_ascii == h.flags)
+    {
+        ascii = base + table_at;
+        for(uint64_t k = 0; k < h.nranges; ++k)
+            for(uint64_t i = offsets[k]; i < offsets[k+1]; ++i)
+                if(ascii[i] != char(first[k] + (i - offsets[k])))
+                    return errc::corrupt_compiled;
+    }
+    else if(flat_utf8 == h.flags)
+    {
+        utf8 = reinterpret_cast<
+            const symbol_table::encoded_char *>(base + table_at);
+        for(uint64_t k = 0; k < h.nranges; ++k)
+            for(uint64_t i = offsets[k]; i < offsets[k+1]; ++i)
+            {
+                symbol_table::encoded_char e = {};
+                e.length = uint32_t(encode_utf8(
+                    first[k] + char32_t(i - offsets[k]), e.bytes));
+                if(0 != std::memcmp(&e, utf8 + i, sizeof(e)))
+                    return errc::corrupt_compiled;
+            }
+    }
+    else
+    {
+        guide = reinterpret_cast<const uint32_t *>(base + table_at);
+        // Has to point at the range holding the bucket's first character,
+        // a later one would make operator[] go wrong.
+        uint64_t k = 0;
+        for(uint64_t b = 0; b < h.nguide; ++b)
+        {
+            while(offsets[k+1] <= (b << h.shift))
+                ++k;
+            if(guide[b] != k)
+                return errc::corrupt_compiled;
+        }
+    }
+    
+    keep = true;
+    map_ = m;
+    size_ = size_t(size);
+    tab_.ascii_ = ascii;
+    tab_.utf8_ = utf8;
+    tab_.guide_ = guide;
+    tab_.nguide_ = guide ? h.nguide : 0;
+    tab_.shift_ = guide ? unsigned(h.shift) : 0;
+    tab_.offsets_ = offsets;
+    tab_.first_ = first;
+    tab_.nranges_ = size_t(h.nranges);
+    
+    ranges_.clear();
+    ranges_.reserve(tab_.ranges());
+    for(size_t k = 0; k < tab_.ranges(); ++k)
+        ranges_.push_back(tab_.range(k));
+    
+    return errc::success;
+}
@@ -0,0 +1,1244 @@
+/*--!>
+This file is part of 'rstr', a simple random string generator written in C++.
+
+Copyright 2016 outshined (outshined@riseup.net)
+    (PGP: 0x8A80C12396A4836F82A93FA79CA3D0F7E8FBCED6)
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, either version 3 of the
+License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+--------------------------------------------------------------------------<!--*/
+#include "core.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <mutex>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef RSTR_X86_SIMD
+#   include <immintrin.h>
+#endif
+
+//------------------------------------------------------------------------------
+static inline errc to_errc(const sex::errc x) noexcept {
+    switch(x)
+    {
+    case sex::errc::unexpected_eof: return errc::unexpected_eof;
+    case sex::errc::invalid_token: return errc::invalid_token;
+    case sex::errc::stray_rbracket: return errc::stray_rbracket;
+    case sex::errc::missing_rbracket: return errc::missing_rbracket;
+    case sex::errc::unexpected_token: return errc::unexpected_token;
+    default: return errc::unknown;
+    }
+}
+//------------------------------------------------------------------------------
+class app_error_category_impl : public fnd::system::error_category
+{
+public:
+    app_error_category_impl() = default;
+    
+    inline const char *name() const noexcept {
+        return "app";
+    }
+    inline fnd::string message(fnd::system::errval_t e) const
+    {
+        using fnd::system::errval_t;
+        
+        switch(e)
+        {
+        case static_cast<errval_t>(errc::success):
+            return "Everything went fine.";
+        case static_cast<errval_t>(errc::expected_lbracket):
+            return "Expected left bracket.";
+        case static_cast<errval_t>(errc::expected_rbracket):
+            return "Expected right bracket.";
+        case static_cast<errval_t>(errc::expected_string):
+            return "Expected a String.";
+        case static_cast<errval_t>(errc::invalid_number):
+            return "Expected a number in the range (U+0 U+1FFFFF).";
+        case static_cast<errval_t>(errc::invalid_range):
+            return "The range is not valid.";
+        case static_cast<errval_t>(errc::inverted_range):
+            return "The range is inverted.";
+        case static_cast<errval_t>(errc::expected_single_character):
+            return "Expected a single character.";
+        case static_cast<errval_t>(errc::unknown_class):
+            return "Unknown Unicode class, try e.g. Letter, Lu or Nd.";
+        case static_cast<errval_t>(errc::unknown_script):
+            return "Unknown Unicode script, try e.g. Latin or Hiragana.";
+        case static_cast<errval_t>(errc::invalid_count):
+            return "Expected a count from 1 to 65536.";
+        case static_cast<errval_t>(errc::invalid_literal):
+            return "Expected a group or a quoted UTF-8 literal.";
+        case static_cast<errval_t>(errc::empty_group):
+            return "The template or group has no characters.";
+        case static_cast<errval_t>(errc::policy_too_long):
+            return "The (at-least ...) counts add up to more than the "
+                "group's count.";
+        case static_cast<errval_t>(errc::unexpected_template):
+            return "Templates can't be used here.";
+        case static_cast<errval_t>(errc::duplicate_template):
+            return "Only one template can be given.";
+        case static_cast<errval_t>(errc::not_compiled):
+            return "Not a compiled config.";
+        case static_cast<errval_t>(errc::unsupported_compiled):
+            return "The config was compiled by another version of rstr "
+                "or on another kind of machine.";
+        case static_cast<errval_t>(errc::corrupt_compiled):
+            return "The compiled config is corrupt.";
+        case static_cast<errval_t>(errc::system_error):
+            return "System error.";
+        case static_cast<errval_t>(errc::unexpected_eof):
+            return "Unexpected EOF.";
+        case static_cast<errval_t>(errc::invalid_token):
+            return "Invalid token.";
+        case static_cast<errval_t>(errc::stray_rbracket):
+            return "Stray right bracket ')' without a matching '('.";
+        case static_cast<errval_t>(errc::missing_rbracket):
+            return "Missing right bracket ')'.";
+        case static_cast<errval_t>(errc::unexpected_token):
+            return "Unexpected token.";
+        default: return "unknown";
+        }
+    }
+    
+    inline fnd::system::error_condition default_error_condition(
+        fnd::system::errval_t e) const noexcept
+    {
+        return fnd::system::error_condition(e, *this);
+    }
+};
+
+//------------------------------------------------------------------------------
+const fnd::system::error_category &app_error_category() noexcept {
+    static app_error_category_impl r;
+    return r;
+}
+
+//------------------------------------------------------------------------------
+fnd::expect<char32_t, errc> parse_value(fnd::const_cstring s)
+{
+    if(s.empty())
+        return errc::expected_string;
+    
+    if('U' == s[0] && s.size() > 1)
+    {
+        if(s.size() < 3)
+            return errc::invalid_number;
+        if('+' == s[1])
+        {
+            s = {s.begin() + 2, s.end()};
+            const char *i = fnd::range::find(s, '0', fnd::not_equal_to<>());
+            if(s.end() == i)
+                return static_cast<char32_t>(0);
+            auto r = fnd::fmt::to_integer<uint32_t>(
+                {i, s.end()}, 16, fnd::nothrow_tag());
+            if(!r.valid())
+                return errc::invalid_number;
+            if(2097151 < r.get())
+                return errc::invalid_number;
+            return static_cast<char32_t>(r.get());
+        }
+        else
+            return errc::invalid_number;
+    }
+    else
+    {
+        if(fnd::utf::unsafe_count(s) != 1)
+            return errc::expected_single_character;
+        return fnd::utf::widen(s);
+    }
+}
+//------------------------------------------------------------------------------
+/** Removes the characters of @p ex from the ranges v[first, end).
+ */
+static void subtract_ranges(
+    fnd::vector<fnd::array<char32_t, 2>> &v,
+    const size_t first,
+    fnd::vector<fnd::array<char32_t, 2>> ex)
+{
+    normalize_ranges(ex, true);
+    
+    fnd::vector<fnd::array<char32_t, 2>> r;
+    for(size_t i = first; i < v.size(); ++i)
+    {
+        char32_t beg = v[i][0];
+        const char32_t end = v[i][1];
+        auto j = std::upper_bound(ex.begin(), ex.end(), beg,
+            [] (const char32_t c, const fnd::array<char32_t, 2> &x) {
+                return c < x[1];
+            });
+        for(; ex.end() != j && (*j)[0] < end; ++j)
+        {
+            if(beg < (*j)[0])
+                r.emplace_back(fnd::array<char32_t, 2>{beg, (*j)[0]});
+            beg = (*j)[1];
+        }
+        if(beg < end)
+            r.emplace_back(fnd::array<char32_t, 2>{beg, end});
+    }
+    
+    v.resize(first);
+    v.insert(v.end(), r.begin(), r.end());
+}
+//------------------------------------------------------------------------------
+/** Counts the lines of a config up to a point, which only moves forward.
+ */
+class line_tracker
+{
+public:
+    explicit line_tracker(const fnd::const_cstring s) noexcept
+    : base_(s.begin()), scanned_(s.begin()), line_begin_(s.begin())
+    {}
+    
+    inline void advance(const char *to) noexcept
+    {
+        while(scanned_ < to)
+        {
+            const void *nl =
+                std::memchr(scanned_, '\n', size_t(to - scanned_));
+            if(!nl)
+            {
+                scanned_ = to;
+                break;
+            }
+            ++line_;
+            scanned_ = line_begin_ = static_cast<const char *>(nl) + 1;
+        }
+    }
+    
+    config_position position(const char *at) noexcept
+    {
+        advance(at);
+        config_position r;
+        r.offset = size_t(at - base_);
+        r.line = line_;
+        r.column = fnd::utf::unsafe_count({line_begin_, at}) + 1;
+        return r;
+    }
+    
+private:
+    const char *base_;
+    const char *scanned_;
+    const char *line_begin_;
+    size_t line_ = 1;
+};
+//------------------------------------------------------------------------------
+/** What a list of items may hold besides characters, classes and scripts.
+ */
+struct list_context
+{
+    line_tracker *lines;
+    token_template *tpl; // takes a (template ...)
+    fnd::vector<token_template::requirement> *at_least; // takes (at-least ...)
+    bool nested; // ends at ')' instead of the end of the config
+};
+//------------------------------------------------------------------------------
+/** @return False unless @p s is well-formed UTF-8, without overlong forms.
+ */
+static bool valid_utf8(const fnd::const_cstring s) noexcept
+{
+    const unsigned char *p =
+        reinterpret_cast<const unsigned char *>(s.begin());
+    const unsigned char *end = reinterpret_cast<const unsigned char *>(s.end());
+    while(p != end)
+    {
+        const unsigned c = *p++;
+        size_t n = 0;
+        char32_t min = 0;
+        if(c < 0x80)
+            continue;
+        else if(c >= 0xC2 && c < 0xE0)
+            n = 1, min = 0x80;
+        else if(c >= 0xE0 && c < 0xF0)
+            n = 2, min = 0x800;
+        else if(c >= 0xF0 && c < 0xF8)
+            n = 3, min = 0x10000;
+        else
+            return false;
+        if(size_t(end - p) < n)
+            return false;
+        char32_t x = c & (0x3F >> n);
+        for(size_t i = 0; i < n; ++i, ++p)
+        {
+            if(0x80 != (*p & 0xC0))
+                return false;
+            x = (x << 6) | (*p & 0x3F);
+        }
+        if(x < min)
+            return false;
+    }
+    return true;
+}
+//------------------------------------------------------------------------------
+/** Reads the count of a group or an (at-least ...) list.
+ */
+static fnd::tuple<errc, size_t> parse_count(
+    sex::iterative_parser<fnd::const_cstring> &sexp,
+    const fnd::const_cstring s,
+    uint32_t &count)
+{
+    auto r = sexp.parse_any_string();
+    if(!r.valid())
+        return {to_errc(sexp.error()), sexp.position()};
+    auto n = fnd::fmt::to_integer<uint32_t>(r.get(), 10, fnd::nothrow_tag());
+    if(!n.valid() || 0 == n.get() || n.get() > token_template::max_count)
+        return {errc::invalid_count, r.get().begin() - s.begin()};
+    count = n.get();
+    return {errc::success, 0};
+}
+//------------------------------------------------------------------------------
+static fnd::tuple<errc, size_t> parse_template(
+    sex::iterative_parser<fnd::const_cstring> &sexp,
+    const fnd::const_cstring s,
+    token_template &tpl,
+    line_tracker *lines,
+    size_t at);
+//------------------------------------------------------------------------------
+static fnd::tuple<errc, size_t> parse_list(
+    sex::iterative_parser<fnd::const_cstring> &sexp,
+    const fnd::const_cstring s,
+    fnd::vector<fnd::array<char32_t, 2>> &v,
+    const list_context &ctx)
+{
+    const size_t first = v.size();
+    fnd::vector<fnd::array<char32_t, 2>> excluded;
+    
+    while(true)
+    {
+        // Keeps the distance to an error short, it's never scanned twice.
+        if(ctx.lines)
+            ctx.lines->advance(s.begin() + sexp.position());
+        
+        fnd::optional<sex::token> tok_ = sexp();
+        if(!tok_.valid())
+            return {to_errc(sexp.error()), sexp.position()};
+        sex::token tok = tok_.get();
+        if(sex::token_id::eof == tok.id())
+        {
+            if(ctx.nested)
+                return {errc::missing_rbracket, sexp.position()};
+            break;
+        }
+        else if(ctx.nested && sex::token_id::rbracket == tok.id())
+            break;
+        else if(sex::token_id::lbracket != tok.id())
+            return {errc::expected_lbracket, tok.value().begin() - s.begin()};
+        
+        auto r = sexp.parse_any_string();
+        if(!r.valid())
+            return {to_errc(sexp.error()), sexp.position()};
+        
+        // Keywords can't be mistaken for characters, which are single ones.
+        const fnd::const_cstring key = r.get();
+        if(key == "template")
+        {
+            const size_t at = key.begin() - s.begin();
+            if(!ctx.tpl)
+                return {errc::unexpected_template, at};
+            if(!ctx.tpl->empty())
+                return {errc::duplicate_template, at};
+            const auto e = parse_template(sexp, s, *ctx.tpl, ctx.lines, at);
+            if(errc::success != fnd::get<0>(e))
+                return e;
+            continue;
+        }
+        if(key == "at-least" && ctx.at_least)
+        {
+            token_template::requirement req;
+            auto e = parse_count(sexp, s, req.count);
+            if(errc::success != fnd::get<0>(e))
+                return e;
+            e = parse_list(sexp, s, req.ranges,
+                list_context{ctx.lines, nullptr, nullptr, true});
+            if(errc::success != fnd::get<0>(e))
+                return e;
+            normalize_ranges(req.ranges, false);
+            if(req.ranges.empty())
+                return {errc::empty_group, key.begin() - s.begin()};
+            ctx.at_least->push_back(fnd::move(req));
+            continue;
+        }
+        if(key == "class" || key == "script" || key == "exclude")
+        {
+            auto name = sexp.parse_any_string();
+            if(!name.valid())
+                return {to_errc(sexp.error()), sexp.position()};
+            bool script = key == "script";
+            if(key == "exclude" && name.get() == "script")
+            {
+                name = sexp.parse_any_string();
+                if(!name.valid())
+                    return {to_errc(sexp.error()), sexp.position()};
+                script = true;
+            }
+            
+            auto &dst = key == "exclude" ? excluded : v;
+            if(!(script ? unicode_script(name.get(), dst)
+                    : unicode_class(name.get(), dst)))
+                return {script ? errc::unknown_script : errc::unknown_class,
+                    name.get().begin() - s.begin()};
+            
+            tok_ = sexp();
+            if(!tok_.valid())
+                return {to_errc(sexp.error()), sexp.position()};
+            tok = tok_.get();
+            if(sex::token_id::rbracket != tok.id())
+                return {errc::expected_rbracket,
+                    tok.value().begin() - s.begin()};
+            continue;
+        }
+        
+        char32_t beg = 0;
+        {
+            auto ret = parse_value(r.get());
+            if(!ret.valid())
+                return {ret.error(), r.get().begin() - s.begin()};
+            beg = ret.get();
+        }
+        char32_t end = beg;
+        
+        tok_ = sexp();
+        if(!tok_.valid())
+            return {to_errc(sexp.error()), sexp.position()};
+        tok = tok_.get();
+        if(sex::token_id::string == tok.id()
+            || sex::token_id::quoted_string == tok.id()
+            || sex::token_id::data == tok.id())
+        {
+            auto ret = parse_value(tok.value());
+            if(!ret.valid())
+                return {ret.error(), tok.value().begin() - s.begin()};
+            end = ret.get();
+            
+            if(beg > end)
+                return {errc::inverted_range, tok.value().begin() - s.begin()};
+            
+            tok_ = sexp();
+            if(!tok_.valid())
+                return {to_errc(sexp.error()), sexp.position()};
+            tok = tok_.get();
+        }
+        
+        if(sex::token_id::rbracket != tok.id())
+            return {errc::expected_rbracket, tok.value().begin() - s.begin()};
+        
+        v.emplace_back(fnd::array<char32_t, 2>{beg, end + 1});
+    }
+    
+    // Surrogates and anything above U+10FFFF can't be encoded as UTF-8,
+    // whether they come from a class or a range like (U+D800 U+DFFF).
+    excluded.emplace_back(fnd::array<char32_t, 2>{0xD800, 0xE000});
+    excluded.emplace_back(fnd::array<char32_t, 2>{0x110000, 0x200000});
+    subtract_ranges(v, first, fnd::move(excluded));
+    return {errc::success, 0};
+}
+//------------------------------------------------------------------------------
+/** Parses the rest of a (template ...) starting at @p at into @p tpl, which
+ * is left alone on errors.
+ */
+static fnd::tuple<errc, size_t> parse_template(
+    sex::iterative_parser<fnd::const_cstring> &sexp,
+    const fnd::const_cstring s,
+    token_template &tpl,
+    line_tracker *lines,
+    const size_t at)
+{
+    token_template r;
+    while(true)
+    {
+        if(lines)
+            lines->advance(s.begin() + sexp.position());
+        
+        fnd::optional<sex::token> tok_ = sexp();
+        if(!tok_.valid())
+            return {to_errc(sexp.error()), sexp.position()};
+        const sex::token tok = tok_.get();
+        if(sex::token_id::rbracket == tok.id())
+            break;
+        else if(sex::token_id::eof == tok.id())
+            return {errc::missing_rbracket, sexp.position()};
+        else if(sex::token_id::quoted_string == tok.id())
+        {
+            if(!valid_utf8(tok.value()))
+                return {errc::invalid_literal, tok.value().begin() - s.begin()};
+            r.add_literal(tok.value());
+            continue;
+        }
+        else if(sex::token_id::lbracket != tok.id())
+            return {errc::invalid_literal, tok.value().begin() - s.begin()};
+        
+        const size_t group_at = sexp.position();
+        uint32_t count = 0;
+        auto e = parse_count(sexp, s, count);
+        if(errc::success != fnd::get<0>(e))
+            return e;
+        
+        fnd::vector<fnd::array<char32_t, 2>> v;
+        fnd::vector<token_template::requirement> at_least;
+        e = parse_list(sexp, s, v,
+            list_context{lines, nullptr, &at_least, true});
+        if(errc::success != fnd::get<0>(e))
+            return e;
+        normalize_ranges(v, false);
+        
+        uint64_t required = 0;
+        for(const auto &req : at_least)
+            required += req.count;
+        if(required > count)
+            return {errc::policy_too_long, group_at};
+        if(v.empty() && required < count)
+            return {errc::empty_group, group_at};
+        r.add_group(v, count, at_least);
+    }
+    
+    if(r.empty())
+        return {errc::empty_group, at};
+    tpl = fnd::move(r);
+    return {errc::success, 0};
+}
+//------------------------------------------------------------------------------
+fnd::tuple<errc, size_t> parse_config(
+    const fnd::const_cstring s,
+    fnd::vector<fnd::array<char32_t, 2>> &v,
+    config_position *where,
+    token_template *tpl)
+{
+    sex::iterative_parser<fnd::const_cstring> sexp(s);
+    if(!where)
+        return parse_list(sexp, s, v,
+            list_context{nullptr, tpl, nullptr, false});
+    
+    line_tracker lines(s);
+    const auto r =
+        parse_list(sexp, s, v, list_context{&lines, tpl, nullptr, false});
+    if(errc::success != fnd::get<0>(r))
+        *where = lines.position(s.begin() + fnd::get<1>(r));
+    return r;
+}
+//------------------------------------------------------------------------------
+config_error parse_config_file(
+    const char *path,
+    fnd::vector<fnd::array<char32_t, 2>> &v,
+    token_template *tpl)
+{
+    config_error r;
+    
+    const int fd = ::open(path, O_RDONLY);
+    if(fd < 0)
+    {
+        r.code = errc::system_error;
+        return r;
+    }
+    n_scope_exit() {
+        ::close(fd);
+    };
+    
+    struct stat st;
+    if(0 != ::fstat(fd, &st))
+    {
+        r.code = errc::system_error;
+        return r;
+    }
+    
+    fnd::const_cstring s;
+    void *m = MAP_FAILED;
+    fnd::vector<char> buf;
+    if(S_ISREG(st.st_mode) && 0 != st.st_size)
+    {
+        m = ::mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE,
+            fd, 0);
+        if(MAP_FAILED != m)
+        {
+            ::madvise(m, size_t(st.st_size), MADV_SEQUENTIAL);
+            const char *p = static_cast<const char *>(m);
+            s = {p, p + st.st_size};
+        }
+    }
+    n_scope_exit() {
+        if(MAP_FAILED != m)
+            ::munmap(m, size_t(st.st_size));
+    };
+    if(MAP_FAILED == m)
+    {
+        char chunk[1 << 16];
+        while(true)
+        {
+            const ssize_t res = ::read(fd, chunk, sizeof(chunk));
+            if(res < 0)
+            {
+                if(EINTR == errno)
+                    continue;
+                r.code = errc::system_error;
+                return r;
+            }
+            if(0 == res)
+                break;
+            buf.insert(buf.end(), chunk, chunk + res);
+        }
+        s = {buf.data(), buf.data() + buf.size()};
+    }
+    
+    r.code = fnd::get<0>(parse_config(s, v, &r.position, tpl));
+    if(errc::success != r.code)
+    {
+        const char *at = s.begin() + r.position.offset;
+        const char *beg = at;
+        while(s.begin() != beg && '\n' != beg[-1])
+            --beg;
+        const char *end = at;
+        while(s.end() != end && '\n' != *end)
+            ++end;
+        r.before.assign(beg, at);
+        r.after.assign(at, end);
+    }
+    return r;
+}
+
+//------------------------------------------------------------------------------
+void normalize_ranges(
+    fnd::vector<fnd::array<char32_t, 2>> &v,
+    const bool unique)
+{
+    if(v.empty())
+        return;
+    
+    std::sort(v.begin(), v.end());
+    size_t k = 0;
+    for(size_t i = 1; i < v.size(); ++i)
+    {
+        if(v[i][0] == v[k][1] || (unique && v[i][0] <= v[k][1]))
+            v[k][1] = std::max(v[k][1], v[i][1]);
+        else
+            v[++k] = v[i];
+    }
+    v.resize(k + 1);
+}
+//------------------------------------------------------------------------------
+alphabet_info describe_ranges(
+    const fnd::vector<fnd::array<char32_t, 2>> &v)
+{
+    alphabet_info r;
+    
+    // Walk the boundaries, each piece in between is added m times.
+    fnd::vector<fnd::tuple<char32_t, int>> ev;
+    ev.reserve(2 * v.size());
+    for(const auto &x : v)
+    {
+        ev.emplace_back(x[0], 1);
+        ev.emplace_back(x[1], -1);
+        r.size += x[1] - x[0];
+    }
+    if(0 == r.size)
+        return r;
+    std::sort(ev.begin(), ev.end());
+    
+    int m = 0;
+    for(size_t i = 0; i + 1 < ev.size(); ++i)
+    {
+        m += fnd::get<1>(ev[i]);
+        const uint64_t len = fnd::get<0>(ev[i+1]) - fnd::get<0>(ev[i]);
+        if(0 == m || 0 == len)
+            continue;
+        const double p = double(m) / double(r.size);
+        r.distinct += len;
+        r.entropy -= double(len) * p * std::log2(p);
+    }
+    return r;
+}
+//------------------------------------------------------------------------------
+const uint32_t chacha20_device::sigma[4] = {
+    0x61707865, 0x3320646e, 0x79622d32, 0x6b206574};
+//------------------------------------------------------------------------------
+chacha20_device::chacha20_device()
+{
+    batch_ = &chacha20_device::batch_scalar;
+#ifdef RSTR_X86_SIMD
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+        batch_ = &chacha20_device::batch_avx2;
+#endif
+    io::read(seed_, reinterpret_cast<char *>(key_), sizeof(key_));
+    refill();
+}
+//------------------------------------------------------------------------------
+void chacha20_device::refill()
+{
+    if(produced_ >= reseed_interval)
+    {
+        uint32_t fresh[8];
+        io::read(seed_, reinterpret_cast<char *>(fresh), sizeof(fresh));
+        for(size_t i = 0; i < 8; ++i)
+            key_[i] ^= fresh[i];
+        secure_zero(fresh, sizeof(fresh));
+        produced_ = 0;
+    }
+    
+    for(size_t i = 0; i < buffer_size; i += batch_size)
+        next_batch(reinterpret_cast<uint32_t *>(
+            reinterpret_cast<char *>(buf_) + i));
+    
+    // The first bytes become the next key and are never served.
+    std::memcpy(key_, buf_, sizeof(key_));
+    counter_ = 0;
+    pos_ = sizeof(key_);
+    produced_ += buffer_size - pos_;
+}
+
+//------------------------------------------------------------------------------
+static inline uint32_t rotl(const uint32_t x, const int n) noexcept {
+    return (x << n) | (x >> (32 - n));
+}
+//------------------------------------------------------------------------------
+void chacha20_device::batch_scalar(
+    const uint32_t *key, const uint64_t counter, uint32_t *out)
+{
+    for(unsigned b = 0; b < 8; ++b)
+    {
+        uint32_t in[16] = {
+            sigma[0], sigma[1], sigma[2], sigma[3],
+            key[0], key[1], key[2], key[3],
+            key[4], key[5], key[6], key[7],
+            uint32_t(counter + b), uint32_t((counter + b) >> 32), 0, 0};
+        uint32_t x[16];
+        std::memcpy(x, in, sizeof(x));
+        
+        auto qr = [&x] (int a, int b, int c, int d) {
+            x[a] += x[b]; x[d] = rotl(x[d] ^ x[a], 16);
+            x[c] += x[d]; x[b] = rotl(x[b] ^ x[c], 12);
+            x[a] += x[b]; x[d] = rotl(x[d] ^ x[a], 8);
+            x[c] += x[d]; x[b] = rotl(x[b] ^ x[c], 7);
+        };
+        for(int i = 0; i < 10; ++i)
+        {
+            qr(0, 4, 8, 12); qr(1, 5, 9, 13);
+            qr(2, 6, 10, 14); qr(3, 7, 11, 15);
+            qr(0, 5, 10, 15); qr(1, 6, 11, 12);
+            qr(2, 7, 8, 13); qr(3, 4, 9, 14);
+        }
+        
+        for(unsigned w = 0; w < 16; ++w)
+            out[8 * w + b] = x[w] + in[w];
+    }
+}
+
+#ifdef RSTR_X86_SIMD
+//------------------------------------------------------------------------------
+__attribute__((target("avx2")))
+static inline void qr_avx2(
+    __m256i *x, const int a, const int b, const int c, const int d,
+    const __m256i rot16, const __m256i rot8) noexcept
+{
+    x[a] = _mm256_add_epi32(x[a], x[b]);
+    x[d] = _mm256_shuffle_epi8(_mm256_xor_si256(x[d], x[a]), rot16);
+    x[c] = _mm256_add_epi32(x[c], x[d]);
+    x[b] = _mm256_xor_si256(x[b], x[c]);
+    x[b] = _mm256_or_si256(
+        _mm256_slli_epi32(x[b], 12), _mm256_srli_epi32(x[b], 20));
+    x[a] = _mm256_add_epi32(x[a], x[b]);
+    x[d] = _mm256_shuffle_epi8(_mm256_xor_si256(x[d], x[a]), rot8);
+    x[c] = _mm256_add_epi32(x[c], x[d]);
+    x[b] = _mm256_xor_si256(x[b], x[c]);
+    x[b] = _mm256_or_si256(
+        _mm256_slli_epi32(x[b], 7), _mm256_srli_epi32(x[b], 25));
+}
+
+//------------------------------------------------------------------------------
+__attribute__((target("avx2")))
+void chacha20_device::batch_avx2(
+    const uint32_t *key, const uint64_t counter, uint32_t *out)
+{
+    __m256i in[16];
+    for(unsigned w = 0; w < 4; ++w)
+        in[w] = _mm256_set1_epi32(int(sigma[w]));
+    for(unsigned w = 0; w < 8; ++w)
+        in[4 + w] = _mm256_set1_epi32(int(key[w]));
+    uint32_t lo[8], hi[8];
+    for(unsigned b = 0; b < 8; ++b)
+    {
+        lo[b] = uint32_t(counter + b);
+        hi[b] = uint32_t((counter + b) >> 32);
+    }
+    in[12] = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(lo));
+    in[13] = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(hi));
+    in[14] = _mm256_setzero_si256();
+    in[15] = _mm256_setzero_si256();
+    
+    __m256i x[16];
+    for(unsigned w = 0; w < 16; ++w)
+        x[w] = in[w];
+    
+    const __m256i rot16 = _mm256_setr_epi8(
+        2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13,
+        2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13);
+    const __m256i rot8 = _mm256_setr_epi8(
+        3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14,
+        3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14);
+    for(int i = 0; i < 10; ++i)
+    {
+        qr_avx2(x, 0, 4, 8, 12, rot16, rot8);
+        qr_avx2(x, 1, 5, 9, 13, rot16, rot8);
+        qr_avx2(x, 2, 6, 10, 14, rot16, rot8);
+        qr_avx2(x, 3, 7, 11, 15, rot16, rot8);
+        qr_avx2(x, 0, 5, 10, 15, rot16, rot8);
+        qr_avx2(x, 1, 6, 11, 12, rot16, rot8);
+        qr_avx2(x, 2, 7, 8, 13, rot16, rot8);
+        qr_avx2(x, 3, 4, 9, 14, rot16, rot8);
+    }
+    
+    for(unsigned w = 0; w < 16; ++w)
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + 8 * w),
+            _mm256_add_epi32(x[w], in[w]));
+}
+#endif
+
+//------------------------------------------------------------------------------
+index_sampler::index_sampler(const uint64_t n)
+: n_(n)
+{
+    if(0 == n)
+        n_throw(logic_error);
+    if(1 == n)
+        return; // needs no entropy at all
+    
+    // The largest power isn't always the best one: 10^19 is barely
+    // above 2^63, so almost half of all words would be rejected.
+    // Pick the k with the most accepted draws per word instead.
+    using u128 = unsigned __int128;
+    const u128 max = u128(1) << 64;
+    u128 best = 0;
+    u128 p = n;
+    for(unsigned k = 1; p <= max; ++k, p *= n)
+    {
+        const u128 t = max % p;
+        const u128 yield = k * (max - t);
+        if(yield > best)
+        {
+            best = yield;
+            k_ = k;
+            // Both wrap to 0 if p == 2^64, nothing is rejected then.
+            p_ = uint64_t(p);
+            threshold_ = uint64_t(t);
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+symbol_table::symbol_table(
+    const fnd::vector<fnd::array<char32_t, 2>> &ranges)
+{
+    if(ranges.empty())
+        n_throw(logic_error);
+    
+    own_offsets_.reserve(ranges.size() + 1);
+    own_first_.reserve(ranges.size());
+    
+    uint64_t n = 0;
+    bool ascii = true;
+    for(const auto &r : ranges)
+    {
+        if(r[0] >= r[1])
+            n_throw(logic_error);
+        own_offsets_.push_back(n);
+        own_first_.push_back(r[0]);
+        n += r[1] - r[0];
+        ascii = ascii && r[1] <= 0x80;
+    }
+    own_offsets_.push_back(n);
+    
+    if(n <= max_flat_size && ascii)
+    {
+        own_ascii_.reserve(n);
+        for(const auto &r : ranges)
+            for(char32_t c = r[0]; c < r[1]; ++c)
+                own_ascii_.push_back(char(c));
+        ascii_ = own_ascii_.data();
+    }
+    else if(n <= max_flat_size)
+    {
+        own_utf8_.reserve(n);
+        for(const auto &r : ranges)
+            for(char32_t c = r[0]; c < r[1]; ++c)
+            {
+                // Zeroed so compiled configs hold no stray bytes.
+                encoded_char e = {};
+                e.length = uint32_t(encode_utf8(c, e.bytes));
+                own_utf8_.push_back(e);
+            }
+        utf8_ = own_utf8_.data();
+    }
+    else
+    {
+        const uint64_t nbuckets = 2 * uint64_t(ranges.size());
+        while(((n - 1) >> shift_) + 1 > nbuckets)
+            ++shift_;
+        own_guide_.resize(((n - 1) >> shift_) + 1);
+        size_t k = 0;
+        for(uint64_t b = 0; b < own_guide_.size(); ++b)
+        {
+            while(own_offsets_[k+1] <= (b << shift_))
+                ++k;
+            own_guide_[b] = uint32_t(k);
+        }
+        guide_ = own_guide_.data();
+        nguide_ = own_guide_.size();
+    }
+    
+    offsets_ = own_offsets_.data();
+    first_ = own_first_.data();
+    nranges_ = own_first_.size();
+}
+
+#ifdef RSTR_X86_SIMD
+//------------------------------------------------------------------------------
+/** Stores the bytes of @p v selected by the 16 bit @p mask contiguously
+ * at @p p, writing 16 bytes at most.
+ */
+__attribute__((target("ssse3")))
+static inline char *compact(
+    const uint8_t (*compact_)[8], const __m128i v, const unsigned mask,
+    char *p) noexcept
+{
+    const unsigned lo = mask & 0xFF;
+    const unsigned hi = mask >> 8;
+    const __m128i slo = _mm_loadl_epi64(
+        reinterpret_cast<const __m128i *>(compact_[lo]));
+    const __m128i shi = _mm_add_epi8(
+        _mm_loadl_epi64(reinterpret_cast<const __m128i *>(compact_[hi])),
+        _mm_set1_epi8(8));
+    _mm_storel_epi64(reinterpret_cast<__m128i *>(p),
+        _mm_shuffle_epi8(v, slo));
+    p += __builtin_popcount(lo);
+    _mm_storel_epi64(reinterpret_cast<__m128i *>(p),
+        _mm_shuffle_epi8(v, shi));
+    return p + __builtin_popcount(hi);
+}
+
+//------------------------------------------------------------------------------
+__attribute__((target("ssse3")))
+size_t ascii_kernel::run_ssse3(
+    const uint8_t *rnd, const size_t n, char *dst) const noexcept
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i nv = _mm_set1_epi16(short(n_));
+    const __m128i lowbyte = _mm_set1_epi16(0xFF);
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+    const __m128i tv = _mm_set1_epi8(char(threshold_));
+    const unsigned ntables = (n_ + 15) / 16;
+    
+    char *p = dst;
+    size_t i = 0;
+    for(; i + 16 <= n; i += 16)
+    {
+        const __m128i r = _mm_loadu_si128(
+            reinterpret_cast<const __m128i *>(rnd + i));
+        const __m128i mlo = _mm_mullo_epi16(
+            _mm_unpacklo_epi8(r, zero), nv);
+        const __m128i mhi = _mm_mullo_epi16(
+            _mm_unpackhi_epi8(r, zero), nv);
+        const __m128i idx = _mm_packus_epi16(
+            _mm_srli_epi16(mlo, 8), _mm_srli_epi16(mhi, 8));
+        const __m128i frac = _mm_packus_epi16(
+            _mm_and_si128(mlo, lowbyte), _mm_and_si128(mhi, lowbyte));
+        const __m128i ok = _mm_cmpeq_epi8(_mm_max_epu8(frac, tv), frac);
+        
+        const __m128i hi = _mm_and_si128(_mm_srli_epi16(idx, 4), nibble);
+        __m128i c = zero;
+        for(unsigned k = 0; k < ntables; ++k)
+        {
+            const __m128i t = _mm_loadu_si128(
+                reinterpret_cast<const __m128i *>(table_ + 16 * k));
+            c = _mm_or_si128(c, _mm_and_si128(
+                _mm_shuffle_epi8(t, idx),
+                _mm_cmpeq_epi8(hi, _mm_set1_epi8(char(k)))));
+        }
+        
+        p = compact(compact_, c, unsigned(_mm_movemask_epi8(ok)), p);
+    }
+    return (p - dst) + run_scalar(rnd + i, n - i, p);
+}
+
+//------------------------------------------------------------------------------
+__attribute__((target("avx2")))
+size_t ascii_kernel::run_avx2(
+    const uint8_t *rnd, const size_t n, char *dst) const noexcept
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i nv = _mm256_set1_epi16(short(n_));
+    const __m256i lowbyte = _mm256_set1_epi16(0xFF);
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+    const __m256i tv = _mm256_set1_epi8(char(threshold_));
+    const unsigned ntables = (n_ + 15) / 16;
+    
+    char *p = dst;
+    size_t i = 0;
+    for(; i + 32 <= n; i += 32)
+    {
+        // unpack and pack both work per 128 bit lane, so the order of
+        // the bytes is preserved.
+        const __m256i r = _mm256_loadu_si256(
+            reinterpret_cast<const __m256i *>(rnd + i));
+        const __m256i mlo = _mm256_mullo_epi16(
+            _mm256_unpacklo_epi8(r, zero), nv);
+        const __m256i mhi = _mm256_mullo_epi16(
+            _mm256_unpackhi_epi8(r, zero), nv);
+        const __m256i idx = _mm256_packus_epi16(
+            _mm256_srli_epi16(mlo, 8), _mm256_srli_epi16(mhi, 8));
+        const __m256i frac = _mm256_packus_epi16(
+            _mm256_and_si256(mlo, lowbyte),
+            _mm256_and_si256(mhi, lowbyte));
+        const __m256i ok = _mm256_cmpeq_epi8(
+            _mm256_max_epu8(frac, tv), frac);
+        
+        const __m256i hi = _mm256_and_si256(
+            _mm256_srli_epi16(idx, 4), nibble);
+        __m256i c = zero;
+        for(unsigned k = 0; k < ntables; ++k)
+        {
+            const __m256i t = _mm256_broadcastsi128_si256(
+                _mm_loadu_si128(
+                    reinterpret_cast<const __m128i *>(table_ + 16 * k)));
+            c = _mm256_or_si256(c, _mm256_and_si256(
+                _mm256_shuffle_epi8(t, idx),
+                _mm256_cmpeq_epi8(hi, _mm256_set1_epi8(char(k)))));
+        }
+        
+        const unsigned mask = unsigned(_mm256_movemask_epi8(ok));
+        p = compact(compact_, _mm256_castsi256_si128(c), mask & 0xFFFF, p);
+        p = compact(compact_, _mm256_extracti128_si256(c, 1), mask >> 16, p);
+    }
+    return (p - dst) + run_scalar(rnd + i, n - i, p);
+}
+#endif
+
+#ifdef RSTR_X86_SIMD
+//------------------------------------------------------------------------------
+/** run_avx2() for alphabets of exactly N characters.
+ */
+template <unsigned N>
+__attribute__((target("avx2")))
+size_t ascii_kernel::run_fixed_avx2(
+    const uint8_t *rnd, const size_t n, char *dst) const noexcept
+{
+    static_assert(0 < N && N <= max_size, "Invalid alphabet size.");
+    constexpr unsigned threshold = 256 % N;
+    constexpr unsigned ntables = (N + 15) / 16;
+    // For N = 2^k, (b * N) >> 8 is just b >> (8 - k).
+    constexpr int shift = 0 != threshold ? 0 :
+        N >= 64 ? 2 : N >= 32 ? 3 : N >= 16 ? 4 : N >= 8 ? 5 : N >= 4 ? 6 : 7;
+    
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i tables[ntables];
+    for(unsigned k = 0; k < ntables; ++k)
+        tables[k] = _mm256_broadcastsi128_si256(_mm_loadu_si128(
+            reinterpret_cast<const __m128i *>(table_ + 16 * k)));
+    
+    char *p = dst;
+    size_t i = 0;
+    for(; i + 32 <= n; i += 32)
+    {
+        const __m256i r = _mm256_loadu_si256(
+            reinterpret_cast<const __m256i *>(rnd + i));
+        __m256i idx, ok;
+        if(0 == threshold)
+        {
+            idx = _mm256_and_si256(_mm256_srli_epi16(r, shift),
+                _mm256_set1_epi8(char(N - 1)));
+            ok = zero; // unused
+        }
+        else
+        {
+            const __m256i nv = _mm256_set1_epi16(short(N));
+            const __m256i lowbyte = _mm256_set1_epi16(0xFF);
+            const __m256i mlo = _mm256_mullo_epi16(
+                _mm256_unpacklo_epi8(r, zero), nv);
+            const __m256i mhi = _mm256_mullo_epi16(
+                _mm256_unpackhi_epi8(r, zero), nv);
+            idx = _mm256_packus_epi16(
+                _mm256_srli_epi16(mlo, 8), _mm256_srli_epi16(mhi, 8));
+            const __m256i frac = _mm256_packus_epi16(
+                _mm256_and_si256(mlo, lowbyte),
+                _mm256_and_si256(mhi, lowbyte));
+            ok = _mm256_cmpeq_epi8(_mm256_max_epu8(
+                frac, _mm256_set1_epi8(char(threshold))), frac);
+        }
+        
+        __m256i c;
+        if(1 == ntables)
+            c = _mm256_shuffle_epi8(tables[0], idx);
+        else
+        {
+            const __m256i hi = _mm256_and_si256(
+                _mm256_srli_epi16(idx, 4), _mm256_set1_epi8(0x0F));
+            c = zero;
+            for(unsigned k = 0; k < ntables; ++k)
+                c = _mm256_or_si256(c, _mm256_and_si256(
+                    _mm256_shuffle_epi8(tables[k], idx),
+                    _mm256_cmpeq_epi8(hi, _mm256_set1_epi8(char(k)))));
+        }
+        
+        if(0 == threshold)
+        {
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(p), c);
+            p += 32;
+        }
+        else
+        {
+            const unsigned mask = unsigned(_mm256_movemask_epi8(ok));
+            p = compact(compact_,
+                _mm256_castsi256_si128(c), mask & 0xFFFF, p);
+            p = compact(compact_,
+                _mm256_extracti128_si256(c, 1), mask >> 16, p);
+        }
+    }
+    return (p - dst) + run_scalar(rnd + i, n - i, p);
+}
+//------------------------------------------------------------------------------
+/** Bitmap of the characters [first, last) of a built-in alphabet.
+ */
+static constexpr uint64_t char_bits(
+    const unsigned half, const unsigned first, const unsigned last) noexcept
+{
+    return first >= last ? 0 :
+        (first >> 6 == half ? uint64_t(1) << (first & 63) : 0)
+            | char_bits(half, first + 1, last);
+}
+//------------------------------------------------------------------------------
+struct ascii_kernel::fixed_alphabet
+{
+    const char *name;
+    unsigned size;
+    uint64_t bits[2];
+    impl_type impl;
+};
+#define RSTR_FIXED_ALPHABET(name, size, bits0, bits1) \
+    {name, size, {bits0, bits1}, &ascii_kernel::run_fixed_avx2<size>}
+//------------------------------------------------------------------------------
+// -0, -A, -a and -x plus the usual encodings. Sizes are checked by the
+// constructor against the bitmaps.
+const ascii_kernel::fixed_alphabet ascii_kernel::fixed_alphabets[] = {
+    RSTR_FIXED_ALPHABET("digits", 10,
+        char_bits(0, '0', '9'+1), 0),
+    RSTR_FIXED_ALPHABET("hex", 16,
+        char_bits(0, '0', '9'+1), char_bits(1, 'a', 'f'+1)),
+    RSTR_FIXED_ALPHABET("HEX", 16,
+        char_bits(0, '0', '9'+1), char_bits(1, 'A', 'F'+1)),
+    RSTR_FIXED_ALPHABET("upper", 26,
+        0, char_bits(1, 'A', 'Z'+1)),
+    RSTR_FIXED_ALPHABET("lower", 26,
+        0, char_bits(1, 'a', 'z'+1)),
+    RSTR_FIXED_ALPHABET("special", 31,
+        char_bits(0, 33, 48) | char_bits(0, 58, 64),
+        char_bits(1, 64, 65) | char_bits(1, 91, 97) | char_bits(1, 123, 126)),
+    RSTR_FIXED_ALPHABET("base32", 32,
+        char_bits(0, '2', '7'+1), char_bits(1, 'A', 'Z'+1)),
+    RSTR_FIXED_ALPHABET("base36", 36,
+        char_bits(0, '0', '9'+1), char_bits(1, 'a', 'z'+1)),
+    RSTR_FIXED_ALPHABET("alpha", 52,
+        0, char_bits(1, 'A', 'Z'+1) | char_bits(1, 'a', 'z'+1)),
+    RSTR_FIXED_ALPHABET("alnum", 62,
+        char_bits(0, '0', '9'+1),
+        char_bits(1, 'A', 'Z'+1) | char_bits(1, 'a', 'z'+1)),
+    RSTR_FIXED_ALPHABET("base64url", 64,
+        char_bits(0, '-', '-'+1) | char_bits(0, '0', '9'+1),
+        char_bits(1, 'A', 'Z'+1) | char_bits(1, '_', '_'+1)
+            | char_bits(1, 'a', 'z'+1)),
+    RSTR_FIXED_ALPHABET("graph", 93,
+        char_bits(0, 33, 64),
+        char_bits(1, 64, 126)),
+    {nullptr, 0, {0, 0}, nullptr}
+};
+#undef RSTR_FIXED_ALPHABET
+#endif
+
+//------------------------------------------------------------------------------
+ascii_kernel::ascii_kernel(const symbol_table &tab)
+{
+    if(!supports(tab))
+        n_throw(logic_error);
+    
+    n_ = unsigned(tab.size());
+    threshold_ = 256 % n_;
+    
+    std::memset(table_, 0, sizeof(table_));
+    for(unsigned i = 0; i < n_; ++i)
+        table_[i] = tab.ascii_at(i);
+    
+    for(unsigned b = 0; b < 256; ++b)
+    {
+        const unsigned m = b * n_;
+        // 0x80 can't be part of the alphabet, so it marks rejects.
+        lut_[b] = (m & 0xFF) < threshold_ ? char(0x80) : table_[m >> 8];
+    }
+    
+    impl_ = &ascii_kernel::run_scalar;
+#ifdef RSTR_X86_SIMD
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+    {
+        impl_ = &ascii_kernel::run_avx2;
+        
+        // The order of the characters doesn't matter, only which they are.
+        uint64_t bits[2] = {0, 0};
+        for(unsigned i = 0; i < n_; ++i)
+            bits[table_[i] >> 6] |= uint64_t(1) << (table_[i] & 63);
+        for(const fixed_alphabet *a = fixed_alphabets; a->name; ++a)
+            if(a->size == n_ && a->bits[0] == bits[0] && a->bits[1] == bits[1])
+            {
+                impl_ = a->impl;
+                alphabet_ = a->name;
+                break;
+            }
+    }
+    else if(__builtin_cpu_supports("ssse3"))
+        impl_ = &ascii_kernel::run_ssse3;
+    
+    for(unsigned m = 0; m < 256; ++m)
+    {
+        unsigned k = 0;
+        for(unsigned i = 0; i < 8; ++i)
+            if(m & (1u << i))
+                compact_[m][k++] = uint8_t(i);
+        for(; k < 8; ++k)
+            compact_[m][k] = 0x80;
+    }
+#endif
+}
+
+//------------------------------------------------------------------------------
+static std::mutex crypt_mutex;
+static size_t crypt_users = 0;
+//------------------------------------------------------------------------------
+void acquire_crypt()
+{
+    std::lock_guard<std::mutex> lock(crypt_mutex);
+    if(0 == crypt_users)
+    {
+        RSTR_STAGE(crypt_init, 0);
+        ncrypt::config cfg;
+        cfg.secure_random_pool = true;
+        ncrypt::init(cfg);
+    }
+    ++crypt_users;
+}
+//------------------------------------------------------------------------------
+void release_crypt() noexcept
+{
+    std::lock_guard<std::mutex> lock(crypt_mutex);
+    if(0 != crypt_users && 0 == --crypt_users)
+        ncrypt::shutdown();
+}
@@ -0,0 +1,1237 @@
+/*--!>
+This file is part of 'rstr', a simple random string generator written in C++.
+
+Copyright 2016 outshined (outshined@riseup.net)
+    (PGP: 0x8A80C12396A4836F82A93FA79CA3D0F7E8FBCED6)
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, either version 3 of the
+License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+--------------------------------------------------------------------------<!--*/
+#ifndef RSTR_CORE_H
+#define RSTR_CORE_H
+
+#include <nebula/foundation/exception.h>
+#include <nebula/foundation/format.h>
+#include <nebula/foundation/cstring.h>
+#include <nebula/foundation/random.h>
+#include <nebula/foundation/utf.h>
+#include <nebula/foundation/expect.h>
+#include <nebula/sex/sex.h>
+#include <nebula/crypt/crypt.h>
+
+#include <cstring>
+#include <utility>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#   define RSTR_X86_SIMD 1
+#endif
+
+#if defined(RSTR_STATS) && defined(RSTR_X86_SIMD)
+#   include <x86intrin.h>
+#endif
+
+namespace fnd = nebula::foundation;
+namespace fmt = fnd::fmt;
+namespace io = fnd::io;
+namespace sex = nebula::sex;
+namespace chrono = fnd::chrono;
+namespace ncrypt = nebula::crypt;
+
+//------------------------------------------------------------------------------
+struct runtime_error : public virtual fnd::runtime_error {};
+struct logic_error : public virtual fnd::logic_error {};
+
+//------------------------------------------------------------------------------
+enum class errc
+{
+    unknown = -1,
+    success = 0,
+    
+    // Parsing errors
+    expected_lbracket,
+    expected_rbracket,
+    expected_string,
+    invalid_number,
+    invalid_range,
+    inverted_range,
+    expected_single_character,
+    unknown_class,
+    unknown_script,
+    invalid_count,
+    invalid_literal,
+    empty_group,
+    policy_too_long,
+    unexpected_template,
+    duplicate_template,
+    
+    // Compiled configs
+    not_compiled,
+    unsupported_compiled,
+    corrupt_compiled,
+    system_error, // see errno
+    
+    // Mapped sex errors
+    unexpected_eof,
+    invalid_token,
+    stray_rbracket,
+    missing_rbracket,
+    unexpected_token
+};
+//------------------------------------------------------------------------------
+const fnd::system::error_category &app_error_category() noexcept;
+
+//------------------------------------------------------------------------------
+n_register_error_code_enum(::errc, ::app_error_category());
+n_register_error_condition_enum(::errc, ::app_error_category());
+
+//------------------------------------------------------------------------------
+enum class random_mode
+{
+    strong,
+    very_strong,
+    crypt_strong,
+    crypt_very_strong,
+    fast_crypt
+};
+
+//------------------------------------------------------------------------------
+/** The stages timed for --stats.
+ */
+enum class stage
+{
+    crypt_init,
+    entropy, // reading from the random device
+    select, // turning entropy into characters
+    encode, // UTF-8
+    output // writing the result
+};
+constexpr size_t stage_count = 5;
+//------------------------------------------------------------------------------
+struct stage_totals
+{
+    uint64_t ticks = 0;
+    uint64_t calls = 0;
+    uint64_t bytes = 0;
+};
+//------------------------------------------------------------------------------
+inline const char *to_cstr(const stage s) noexcept
+{
+    switch(s)
+    {
+    case stage::crypt_init: return "crypt-init";
+    case stage::entropy: return "entropy";
+    case stage::select: return "select";
+    case stage::encode: return "encode";
+    case stage::output: return "output";
+    default: return "unknown";
+    }
+}
+
+#ifdef RSTR_STATS
+//------------------------------------------------------------------------------
+/** Set by enable_stats(), before any other thread is started.
+ */
+extern bool stats_enabled;
+void enable_stats();
+stage_totals read_stats(stage s) noexcept;
+/** @return The seconds since enable_stats().
+ */
+double stats_seconds();
+/** @return The ticks of stats_ticks() per second, measured since
+ *  enable_stats().
+ */
+double stats_tick_rate();
+void add_stage(stage s, uint64_t ticks, uint64_t bytes) noexcept;
+//------------------------------------------------------------------------------
+/** The time stamp counter where there is one, nanoseconds otherwise.
+ */
+inline uint64_t stats_ticks() noexcept
+{
+#ifdef RSTR_X86_SIMD
+    return __rdtsc();
+#else
+    return uint64_t(chrono::duration_cast<chrono::nanoseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+}
+//------------------------------------------------------------------------------
+/** Adds the time until its destruction to a stage, except for the time of
+ * the stage_timers nested in it, which goes to their own stages.
+ *
+ * Only meant for whole blocks and batches, it costs two reads of the time
+ * stamp counter and a few atomic additions.
+ */
+class stage_timer
+{
+public:
+    explicit stage_timer(const stage s, const uint64_t bytes = 0) noexcept
+    : s_(s), bytes_(bytes)
+    {
+        if(!stats_enabled)
+            return;
+        outer_ = nested_;
+        nested_ = 0;
+        start_ = stats_ticks();
+    }
+    stage_timer(const stage_timer &) = delete;
+    stage_timer &operator=(const stage_timer &) = delete;
+    
+    ~stage_timer()
+    {
+        if(!stats_enabled)
+            return;
+        const uint64_t t = stats_ticks() - start_;
+        add_stage(s_, t - nested_, bytes_);
+        nested_ = outer_ + t;
+    }
+    
+private:
+    // The ticks of the timers nested in the innermost one.
+    static thread_local uint64_t nested_;
+    
+    stage s_;
+    uint64_t bytes_;
+    uint64_t start_ = 0;
+    uint64_t outer_ = 0;
+};
+#   define RSTR_STAGE(s, bytes) \
+        const stage_timer rstr_stage_timer_(stage::s, bytes)
+#else
+#   define RSTR_STAGE(s, bytes) static_cast<void>(0)
+#endif
+
+//------------------------------------------------------------------------------
+/** Parses a single character, either as UTF-8 or as U+XXXX.
+ */
+fnd::expect<char32_t, errc> parse_value(fnd::const_cstring s);
+//------------------------------------------------------------------------------
+/** A position in a config, line and column counting from 1, the column in
+ * characters.
+ */
+struct config_position
+{
+    size_t offset = 0;
+    size_t line = 1;
+    size_t column = 1;
+};
+//------------------------------------------------------------------------------
+class token_template;
+//------------------------------------------------------------------------------
+/** Appends the ranges of the config @p s to @p v, as half-open ranges.
+ *
+ * (exclude ...) lists remove characters from the ranges added by @p s only,
+ * as is done with surrogates and code points above U+10FFFF.
+ * If @p where is given, the line is tracked while parsing and the position
+ * of an error is stored there, without going over @p s again.
+ * A (template ...) is stored in @p tpl, without it it's an error.
+ * @return The error and its position in @p s.
+ */
+fnd::tuple<errc, size_t> parse_config(
+    const fnd::const_cstring s,
+    fnd::vector<fnd::array<char32_t, 2>> &v,
+    config_position *where = nullptr,
+    token_template *tpl = nullptr);
+//------------------------------------------------------------------------------
+/** An error in a config file, see parse_config_file().
+ */
+struct config_error
+{
+    errc code = errc::success;
+    config_position position;
+    fnd::string before; // The line up to the error,
+    fnd::string after; // and the rest of it.
+};
+//------------------------------------------------------------------------------
+/** Like parse_config(), but for the file @p path, which is mapped instead of
+ * read into memory, so the memory used is about that of the ranges. Pipes
+ * and other files which can't be mapped are read whole.
+ * @return errc::system_error with errno set if the file can't be read.
+ */
+config_error parse_config_file(
+    const char *path,
+    fnd::vector<fnd::array<char32_t, 2>> &v,
+    token_template *tpl = nullptr);
+//------------------------------------------------------------------------------
+/** Appends the characters of the General_Category @p name to @p v, which
+ * can be a category like Lu or Uppercase_Letter or a group like L or Letter.
+ * Names are matched loosely, ignoring case, spaces, '-' and '_'. Cs and Cn
+ * never add anything.
+ * @return False if there is no such category.
+ */
+bool unicode_class(
+    fnd::const_cstring name,
+    fnd::vector<fnd::array<char32_t, 2>> &v);
+/** Like unicode_class() for the assigned characters of a Script like
+ * Hiragana or Hira.
+ */
+bool unicode_script(
+    fnd::const_cstring name,
+    fnd::vector<fnd::array<char32_t, 2>> &v);
+//------------------------------------------------------------------------------
+/** Sorts the ranges @p v and merges the ones that touch, which doesn't change
+ * how likely a character is. With @p unique overlapping ranges are merged
+ * as well, so every character is added only once.
+ */
+void normalize_ranges(
+    fnd::vector<fnd::array<char32_t, 2>> &v,
+    bool unique);
+//------------------------------------------------------------------------------
+struct alphabet_info
+{
+    /** The number of characters, counting duplicates. */
+    uint64_t size = 0;
+    /** The number of different characters. */
+    uint64_t distinct = 0;
+    /** The Shannon entropy of a character in bits. */
+    double entropy = 0;
+};
+/** Describes the alphabet given by the ranges @p v.
+ */
+alphabet_info describe_ranges(
+    const fnd::vector<fnd::array<char32_t, 2>> &v);
+
+//------------------------------------------------------------------------------
+/** Overwrites memory in a way the optimizer won't elide.
+ */
+inline void secure_zero(void *p, size_t n) noexcept
+{
+#if defined(__GNUC__)
+    std::memset(p, 0, n);
+    // Tell the compiler the memory is still looked at.
+    __asm__ __volatile__("" : : "r"(p) : "memory");
+#else
+    volatile char *q = static_cast<volatile char *>(p);
+    while(n--)
+        *q++ = 0;
+#endif
+}
+
+//------------------------------------------------------------------------------
+/** A userspace CSPRNG generating the ChaCha20 keystream in bulk.
+ *
+ * The key is taken from ncrypt::random_device. It uses fast key erasure:
+ * every refill of the buffer also produces the next key, and served bytes
+ * are wiped, so the state never reveals earlier output. Every
+ * reseed_interval bytes fresh entropy from the device is mixed into the
+ * key.
+ *
+ * Eight blocks are computed at a time (with AVX2 if available), their words
+ * interleaved, which is just a fixed permutation of the keystream.
+ */
+class chacha20_device
+{
+public:
+    static constexpr size_t block_size = 64;
+    static constexpr size_t batch_size = 8 * block_size;
+    static constexpr size_t buffer_size = 16 * batch_size;
+    static constexpr uint64_t reseed_interval = uint64_t(1) << 30;
+    
+    chacha20_device();
+    chacha20_device(const chacha20_device &) = delete;
+    chacha20_device &operator=(const chacha20_device &) = delete;
+    
+    ~chacha20_device()
+    {
+        secure_zero(key_, sizeof(key_));
+        secure_zero(buf_, sizeof(buf_));
+    }
+    
+    void read(char *dst, size_t n)
+    {
+        while(0 != n)
+        {
+            if(buffer_size == pos_)
+            {
+                // Large requests skip the buffer, the key still gets
+                // replaced by the following refill().
+                if(n >= batch_size)
+                {
+                    const size_t m = n - n % batch_size;
+                    for(size_t i = 0; i < m; i += batch_size)
+                        next_batch(reinterpret_cast<uint32_t *>(dst + i));
+                    produced_ += m;
+                    dst += m;
+                    n -= m;
+                }
+                refill();
+                continue;
+            }
+            
+            const size_t m = buffer_size - pos_ < n ? buffer_size - pos_ : n;
+            char *src = reinterpret_cast<char *>(buf_) + pos_;
+            std::memcpy(dst, src, m);
+            secure_zero(src, m);
+            pos_ += m;
+            dst += m;
+            n -= m;
+        }
+    }
+    
+private:
+    using batch_type = void (*)(const uint32_t *, uint64_t, uint32_t *);
+    
+    static const uint32_t sigma[4];
+    
+    inline void next_batch(uint32_t *out)
+    {
+        batch_(key_, counter_, out);
+        counter_ += 8;
+    }
+    
+    void refill();
+    
+    static void batch_scalar(
+        const uint32_t *key, uint64_t counter, uint32_t *out);
+#ifdef RSTR_X86_SIMD
+    static void batch_avx2(
+        const uint32_t *key, uint64_t counter, uint32_t *out);
+#endif
+    
+    ncrypt::random_device seed_;
+    batch_type batch_;
+    uint32_t key_[8];
+    uint64_t counter_ = 0;
+    uint64_t produced_ = 0;
+    size_t pos_ = buffer_size;
+    uint32_t buf_[buffer_size / sizeof(uint32_t)];
+};
+
+//------------------------------------------------------------------------------
+template <class Rnd>
+inline void read_random(Rnd &rnd, char *p, const size_t n)
+{
+    RSTR_STAGE(entropy, n);
+    io::read(rnd, p, n);
+}
+inline void read_random(chacha20_device &rnd, char *p, const size_t n)
+{
+    RSTR_STAGE(entropy, n);
+    rnd.read(p, n);
+}
+
+//------------------------------------------------------------------------------
+/** Reads entropy from a random device in blocks of block_size() bytes and
+ * serves it one 64 bit word at a time.
+ */
+template <class Rnd>
+class block_entropy
+{
+public:
+    static constexpr size_t default_block_size = 4096;
+    
+    explicit block_entropy(
+        Rnd &rnd,
+        const size_t block_size = default_block_size)
+    : rnd_(rnd)
+    {
+        // Round up to whole words.
+        const size_t n = (block_size + sizeof(uint64_t) - 1)
+            / sizeof(uint64_t);
+        buf_.resize(0 == n ? 1 : n);
+        pos_ = buf_.size();
+    }
+    block_entropy(block_entropy &&) = default;
+    
+    ~block_entropy()
+    {
+        secure_zero(buf_.data(), buf_.size() * sizeof(uint64_t));
+    }
+    
+    inline uint64_t next()
+    {
+        if(buf_.size() == pos_)
+            refill();
+        return buf_[pos_++];
+    }
+    
+    /** Takes up to @p n words at once.
+     * @param n Is set to the number of words actually taken, which is at
+     *  least one.
+     */
+    inline const uint64_t *take(size_t &n)
+    {
+        if(buf_.size() == pos_)
+            refill();
+        const size_t avail = buf_.size() - pos_;
+        if(n > avail || 0 == n)
+            n = 0 == n ? 1 : avail;
+        const uint64_t *r = buf_.data() + pos_;
+        pos_ += n;
+        return r;
+    }
+    
+    /** @return The number of bytes read from the device so far.
+     */
+    inline uint64_t bytes_read() const noexcept {
+        return bytes_read_;
+    }
+    inline size_t block_size() const noexcept {
+        return buf_.size() * sizeof(uint64_t);
+    }
+    
+private:
+    inline void refill()
+    {
+        read_random(rnd_, reinterpret_cast<char *>(buf_.data()), block_size());
+        bytes_read_ += block_size();
+        pos_ = 0;
+    }
+    
+    Rnd &rnd_;
+    fnd::vector<uint64_t> buf_;
+    size_t pos_;
+    uint64_t bytes_read_ = 0;
+};
+//------------------------------------------------------------------------------
+template <class Rnd>
+inline block_entropy<Rnd> make_block_entropy(
+    Rnd &rnd, const size_t block_size)
+{
+    return block_entropy<Rnd>(rnd, block_size);
+}
+
+//------------------------------------------------------------------------------
+/** Draws uniformly distributed integers in [0, size()) and uses only about
+ * log2(size()) bits of entropy per draw.
+ *
+ * This is Lemire's multiply-shift method applied to p = size()^k, a power
+ * of size() that fits into 64 bits: a word x is rejected if
+ * (x * p) mod 2^64 is below 2^64 mod p, otherwise floor(x * p / 2^64) is
+ * uniform in [0, p). Its k base size() digits are the draws, peeled off
+ * one multiplication at a time. No division happens after construction.
+ */
+class index_sampler
+{
+public:
+    explicit index_sampler(uint64_t n);
+    
+    template <class Entropy>
+    inline uint64_t operator () (Entropy &src)
+    {
+        if(0 == left_)
+        {
+            if(1 == n_)
+                return 0;
+            do {
+                frac_ = src.next();
+                ++words_;
+            } while(frac_ * p_ < threshold_);
+            left_ = k_;
+        }
+        const unsigned __int128 m =
+            static_cast<unsigned __int128>(frac_) * n_;
+        frac_ = uint64_t(m);
+        --left_;
+        return uint64_t(m >> 64);
+    }
+    
+    inline uint64_t size() const noexcept {
+        return n_;
+    }
+    /** @return The number of draws packed into one 64 bit word.
+     */
+    inline unsigned draws_per_word() const noexcept {
+        return k_;
+    }
+    /** @return The number of 64 bit words consumed so far.
+     */
+    inline uint64_t words() const noexcept {
+        return words_;
+    }
+    
+private:
+    uint64_t n_;
+    unsigned k_ = 0;
+    uint64_t p_ = 0;
+    uint64_t threshold_ = 0;
+    uint64_t frac_ = 0;
+    unsigned left_ = 0;
+    uint64_t words_ = 0;
+};
+//------------------------------------------------------------------------------
+/** Draws from [0, n) for an n given with every draw, like the swaps of a
+ * Fisher-Yates shuffle.
+ *
+ * Keeps a value uniform in [0, range) and takes it apart with divisions:
+ * if it's below the largest multiple of n, value mod n is the draw and
+ * value / n stays uniform in [0, range / n). Otherwise the excess is still
+ * uniform in a smaller range. Either way nothing is thrown away, and the
+ * value is topped up with 32 bits at a time, so a draw costs about log2(n)
+ * bits.
+ */
+class bounded_sampler
+{
+public:
+    static constexpr uint64_t max_bound = uint64_t(1) << 31;
+    
+    /** @param n In [1, max_bound].
+     */
+    template <class Entropy>
+    inline uint64_t operator () (Entropy &src, const uint64_t n)
+    {
+        while(true)
+        {
+            while(range_ < max_bound)
+            {
+                if(0 == halves_)
+                {
+                    word_ = src.next();
+                    halves_ = 2;
+                }
+                value_ = (value_ << 32) | (word_ & 0xFFFFFFFF);
+                range_ <<= 32;
+                word_ >>= 32;
+                --halves_;
+            }
+            
+            const uint64_t q = range_ / n;
+            if(value_ < q * n)
+            {
+                const uint64_t r = value_ % n;
+                value_ /= n;
+                range_ = q;
+                return r;
+            }
+            value_ -= q * n;
+            range_ -= q * n;
+        }
+    }
+    
+private:
+    uint64_t value_ = 0;
+    uint64_t range_ = 1;
+    uint64_t word_ = 0;
+    unsigned halves_ = 0;
+};
+
+//------------------------------------------------------------------------------
+/** Writes the UTF-8 encoding of @p c to @p dst, which must have room for 4
+ * bytes, and returns its length. Like parse_value() this accepts anything
+ * up to U+1FFFFF.
+ */
+inline size_t encode_utf8(const char32_t c, char *dst) noexcept
+{
+    if(c < 0x80)
+    {
+        dst[0] = char(c);
+        return 1;
+    }
+    else if(c < 0x800)
+    {
+        dst[0] = char(0xC0 | (c >> 6));
+        dst[1] = char(0x80 | (c & 0x3F));
+        return 2;
+    }
+    else if(c < 0x10000)
+    {
+        dst[0] = char(0xE0 | (c >> 12));
+        dst[1] = char(0x80 | ((c >> 6) & 0x3F));
+        dst[2] = char(0x80 | (c & 0x3F));
+        return 3;
+    }
+    else
+    {
+        dst[0] = char(0xF0 | (c >> 18));
+        dst[1] = char(0x80 | ((c >> 12) & 0x3F));
+        dst[2] = char(0x80 | ((c >> 6) & 0x3F));
+        dst[3] = char(0x80 | (c & 0x3F));
+        return 4;
+    }
+}
+
+//------------------------------------------------------------------------------
+/** Maps an index in [0, size()) to a character of the alphabet given as a
+ * list of half-open ranges, in constant time.
+ *
+ * Alphabets of up to max_flat_size characters are expanded into a flat
+ * table of UTF-8 sequences (or just bytes if all of them are ASCII), so
+ * that encoding a character is a copy. Larger ones use a guide table: the
+ * index space is cut into about twice as many buckets as there are ranges,
+ * each remembering the first range it overlaps, so a lookup scans about
+ * one range on average.
+ *
+ * The tables can also live in a file mapped by mapped_charset.
+ */
+class symbol_table
+{
+public:
+    static constexpr uint64_t max_flat_size = 1 << 16;
+    
+    explicit symbol_table(
+        const fnd::vector<fnd::array<char32_t, 2>> &ranges);
+    symbol_table(symbol_table &&) = default;
+    symbol_table(const symbol_table &) = delete;
+    symbol_table &operator=(const symbol_table &) = delete;
+    
+    /** @return The number of characters, counting duplicates.
+     */
+    inline uint64_t size() const noexcept {
+        return offsets_[nranges_];
+    }
+    /** @return The number of ranges.
+     */
+    inline size_t ranges() const noexcept {
+        return nranges_;
+    }
+    /** @return The k-th range, as a half-open range.
+     */
+    inline fnd::array<char32_t, 2> range(const size_t k) const noexcept {
+        return {first_[k], first_[k] + char32_t(offsets_[k+1] - offsets_[k])};
+    }
+    /** @return True if every character is encoded as a single byte, see
+     *  ascii_at().
+     */
+    inline bool ascii() const noexcept {
+        return nullptr != ascii_;
+    }
+    
+    inline char32_t operator [] (const uint64_t i) const noexcept
+    {
+        size_t k = nullptr == guide_ ? 0 : guide_[i >> shift_];
+        while(offsets_[k+1] <= i)
+            ++k;
+        return first_[k] + char32_t(i - offsets_[k]);
+    }
+    
+    inline char ascii_at(const uint64_t i) const noexcept {
+        return ascii_[i];
+    }
+    /** Writes the UTF-8 encoding of the i-th character to @p dst, which must
+     * have room for 4 bytes.
+     * @return The number of bytes written.
+     */
+    inline size_t encode(const uint64_t i, char *dst) const noexcept
+    {
+        if(nullptr != utf8_)
+        {
+            const encoded_char &e = utf8_[i];
+            std::memcpy(dst, e.bytes, 4);
+            return e.length;
+        }
+        return encode_utf8((*this)[i], dst);
+    }
+    
+private:
+    friend class mapped_charset;
+    friend errc save_charset(const symbol_table &, const char *);
+    
+    struct encoded_char
+    {
+        char bytes[4];
+        uint32_t length;
+    };
+    
+    symbol_table() = default;
+    
+    // Either into the vectors below or into a mapped file.
+    const uint64_t *offsets_ = nullptr; // ranges() + 1 cumulative offsets
+    const char32_t *first_ = nullptr;
+    const char *ascii_ = nullptr;
+    const encoded_char *utf8_ = nullptr;
+    const uint32_t *guide_ = nullptr;
+    size_t nranges_ = 0;
+    uint64_t nguide_ = 0;
+    unsigned shift_ = 0;
+    
+    fnd::vector<uint64_t> own_offsets_;
+    fnd::vector<char32_t> own_first_;
+    fnd::vector<char> own_ascii_;
+    fnd::vector<encoded_char> own_utf8_;
+    fnd::vector<uint32_t> own_guide_;
+};
+
+//------------------------------------------------------------------------------
+/** Writes @p tab to the file @p path in the format read by mapped_charset.
+ */
+errc save_charset(const symbol_table &tab, const char *path);
+//------------------------------------------------------------------------------
+/** A compiled config written by save_charset(), mapped into memory.
+ *
+ * The file holds the tables of a symbol_table as they are in memory, behind
+ * a header with a version, the byte order and a checksum. Loading checks
+ * these and the structure of the tables but parses nothing, so the tables
+ * of large alphabets don't have to be built on every start.
+ */
+class mapped_charset
+{
+public:
+    static constexpr uint32_t version = 2;
+    
+    mapped_charset() = default;
+    mapped_charset(const mapped_charset &) = delete;
+    mapped_charset &operator=(const mapped_charset &) = delete;
+    ~mapped_charset();
+    
+    /** @return errc::not_compiled if @p path is something else, like a
+     *  config to be parsed.
+     */
+    errc open(const char *path);
+    
+    inline const symbol_table &table() const noexcept {
+        return tab_;
+    }
+    /** @return The normalized ranges the file was compiled from.
+     */
+    inline const fnd::vector<fnd::array<char32_t, 2>> &ranges()
+        const noexcept
+    {
+        return ranges_;
+    }
+    
+private:
+    void *map_ = nullptr;
+    size_t size_ = 0;
+    symbol_table tab_;
+    fnd::vector<fnd::array<char32_t, 2>> ranges_;
+};
+
+//------------------------------------------------------------------------------
+/** Generates @p length characters straight into @p out, which must provide
+ * reserve() and commit() like output_buffer.
+ * @param sampler Must draw from [0, tab.size()).
+ */
+template <class Entropy, class Out>
+inline void gen_from_ranges(
+    const symbol_table &tab,
+    index_sampler &sampler,
+    size_t length,
+    Entropy &src,
+    Out &out)
+{
+    constexpr size_t batch = 1024;
+    
+    if(sampler.size() != tab.size())
+        n_throw(logic_error);
+    
+    while(0 != length)
+    {
+        const size_t n = length < batch ? length : batch;
+        char *const beg = out.reserve(tab.ascii() ? n : 4 * n);
+        char *p = beg;
+        
+        if(tab.ascii())
+        {
+            RSTR_STAGE(select, n);
+            for(size_t i = 0; i < n; ++i)
+                *p++ = tab.ascii_at(sampler(src));
+        }
+        else
+        {
+            // Drawing all indices first keeps both loops tight.
+            uint64_t idx[batch];
+            {
+                RSTR_STAGE(select, n);
+                for(size_t i = 0; i < n; ++i)
+                    idx[i] = sampler(src);
+            }
+            {
+                RSTR_STAGE(encode, n);
+                for(size_t i = 0; i < n; ++i)
+                    p += tab.encode(idx[i], p);
+            }
+            secure_zero(idx, n * sizeof(uint64_t));
+        }
+        
+        out.commit(p - beg);
+        length -= n;
+    }
+}
+
+//------------------------------------------------------------------------------
+/** Turns random bytes into characters of an ASCII alphabet of up to 128
+ * characters, 16 or 32 bytes at a time if the CPU supports SSSE3 or AVX2.
+ *
+ * Each byte b is mapped with an 8 bit version of the multiply-shift method
+ * in index_sampler: the character is table[(b * n) >> 8] unless
+ * (b * n) mod 256 < 256 mod n, in which case the byte is dropped. This
+ * spends 8 bits of entropy on every character, so it is not meant for the
+ * very-strong modes.
+ *
+ * Common alphabets like the built-in sets, hex or base64url get kernels of
+ * their own with size, threshold and table count fixed at compile time. For
+ * sizes that are powers of two nothing is ever rejected, so those just store
+ * whole vectors.
+ */
+class ascii_kernel
+{
+public:
+    static constexpr uint64_t max_size = 128;
+    
+    static bool supports(const symbol_table &tab) noexcept {
+        return tab.ascii() && tab.size() <= max_size;
+    }
+    
+    explicit ascii_kernel(const symbol_table &tab);
+    
+    /** @return The name of the implementation picked for this CPU.
+     */
+    inline const char *name() const noexcept
+    {
+#ifdef RSTR_X86_SIMD
+        if(&ascii_kernel::run_avx2 == impl_ || nullptr != alphabet_)
+            return "AVX2";
+        else if(&ascii_kernel::run_ssse3 == impl_)
+            return "SSSE3";
+#endif
+        return "scalar";
+    }
+    /** @return The name of the alphabet the kernel is specialized for, or
+     *  null.
+     */
+    inline const char *alphabet() const noexcept {
+        return alphabet_;
+    }
+    
+    /** Converts @p n random bytes into at most @p n characters.
+     * @param dst Must have room for n + 8 bytes.
+     * @return The number of characters written to @p dst.
+     */
+    inline size_t operator () (
+        const uint8_t *rnd, const size_t n, char *dst) const noexcept
+    {
+        return (this->*impl_)(rnd, n, dst);
+    }
+    
+private:
+    inline size_t run_scalar(
+        const uint8_t *rnd, const size_t n, char *dst) const noexcept
+    {
+        char *p = dst;
+        for(size_t i = 0; i < n; ++i)
+        {
+            const char c = lut_[rnd[i]];
+            *p = c;
+            p += !(c & 0x80);
+        }
+        return p - dst;
+    }
+    
+#ifdef RSTR_X86_SIMD
+    size_t run_ssse3(
+        const uint8_t *rnd, size_t n, char *dst) const noexcept;
+    size_t run_avx2(
+        const uint8_t *rnd, size_t n, char *dst) const noexcept;
+    template <unsigned N>
+    size_t run_fixed_avx2(
+        const uint8_t *rnd, size_t n, char *dst) const noexcept;
+#endif
+    
+    using impl_type = size_t (ascii_kernel::*)(
+        const uint8_t *, size_t, char *) const noexcept;
+    
+    struct fixed_alphabet;
+    static const fixed_alphabet fixed_alphabets[];
+    
+    unsigned n_;
+    unsigned threshold_;
+    impl_type impl_;
+    const char *alphabet_ = nullptr;
+    char table_[max_size];
+    char lut_[256];
+#ifdef RSTR_X86_SIMD
+    uint8_t compact_[256][8];
+#endif
+};
+
+//------------------------------------------------------------------------------
+/** Like gen_from_ranges() but using an ascii_kernel.
+ */
+template <class Entropy, class Out>
+inline void gen_ascii(
+    const ascii_kernel &kernel,
+    size_t length,
+    Entropy &src,
+    Out &out)
+{
+    constexpr size_t batch = 4096;
+    
+    while(0 != length)
+    {
+        // The kernel never writes more characters than it gets bytes, so
+        // asking for at most 'length' bytes doesn't waste anything.
+        const size_t want = length < batch ? length : batch;
+        size_t nwords = (want + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+        const uint8_t *rnd = reinterpret_cast<const uint8_t *>(
+            src.take(nwords));
+        const size_t nbytes = nwords * sizeof(uint64_t) < want ?
+            nwords * sizeof(uint64_t) : want;
+        
+        char *dst = out.reserve(nbytes + 8);
+        RSTR_STAGE(select, nbytes);
+        const size_t n = kernel(rnd, nbytes, dst);
+        out.commit(n);
+        length -= n;
+    }
+}
+
+//------------------------------------------------------------------------------
+/** A (template ...) config compiled into a flat plan of steps, each copying
+ * a literal or drawing characters from one of the template's tables.
+ *
+ * A group with (at-least K ...) lists draws K characters from each list and
+ * the rest from the group's own characters, then shuffles them, so every
+ * token meets the requirements by construction and none is ever thrown
+ * away. Groups with the same characters share a table, and so a sampler.
+ */
+class token_template
+{
+public:
+    enum class op : uint32_t
+    {
+        literal, // count bytes of literals() from offset
+        draw, // count characters of table()
+        collect, // count characters of table() into the shuffle buffer
+        shuffle // the count characters in the buffer, shuffled
+    };
+    struct step
+    {
+        op what;
+        uint32_t table;
+        uint32_t count;
+        uint32_t offset;
+    };
+    /** An (at-least count ...) list of a group.
+     */
+    struct requirement
+    {
+        uint32_t count;
+        fnd::vector<fnd::array<char32_t, 2>> ranges;
+    };
+    
+    static constexpr uint32_t max_count = 1 << 16;
+    
+    token_template() = default;
+    token_template(token_template &&) = default;
+    token_template &operator=(token_template &&) = default;
+    
+    void add_literal(fnd::const_cstring s);
+    /** Builds an ascii_kernel for every table that supports one, which is
+     *  then used for groups without requirements. Not for the modes that
+     *  drain entropy, like with single alphabets.
+     *  @return The number of kernels.
+     */
+    size_t use_kernels();
+    /** @param ranges Normalized, like the ranges of @p at_least, whose counts
+     *  add up to at most @p count.
+     */
+    void add_group(
+        const fnd::vector<fnd::array<char32_t, 2>> &ranges,
+        uint32_t count,
+        const fnd::vector<requirement> &at_least);
+    
+    inline bool empty() const noexcept {
+        return steps_.empty();
+    }
+    inline const fnd::vector<step> &steps() const noexcept {
+        return steps_;
+    }
+    inline size_t tables() const noexcept {
+        return tables_.size();
+    }
+    inline const symbol_table &table(const size_t i) const noexcept {
+        return tables_[i];
+    }
+    /** @return The kernel for the i-th table, if use_kernels() built one.
+     */
+    inline const ascii_kernel *kernel(const size_t i) const noexcept {
+        return i < kernels_.size() && kernels_[i].valid() ?
+            &kernels_[i].get() : nullptr;
+    }
+    inline const char *literals() const noexcept {
+        return literals_.data();
+    }
+    /** @return The number of characters in a token.
+     */
+    inline uint64_t length() const noexcept {
+        return length_;
+    }
+    /** @return The most bytes a token can take.
+     */
+    inline uint64_t max_size() const noexcept {
+        return max_size_;
+    }
+    /** @return The size of the largest group to be shuffled.
+     */
+    inline uint32_t max_shuffle() const noexcept {
+        return max_shuffle_;
+    }
+    
+private:
+    uint32_t add_table(const fnd::vector<fnd::array<char32_t, 2>> &ranges);
+    
+    fnd::vector<step> steps_;
+    fnd::vector<symbol_table> tables_;
+    fnd::vector<fnd::optional<ascii_kernel>> kernels_;
+    fnd::vector<fnd::vector<fnd::array<char32_t, 2>>> table_ranges_;
+    fnd::vector<char> literals_;
+    uint64_t length_ = 0;
+    uint64_t max_size_ = 0;
+    uint32_t max_shuffle_ = 0;
+};
+//------------------------------------------------------------------------------
+/** The samplers a thread needs for a token_template, which keep their
+ * entropy from one token to the next.
+ */
+struct template_state
+{
+    explicit template_state(const token_template &tpl);
+    template_state(template_state &&) = default;
+    ~template_state();
+    
+    fnd::vector<index_sampler> samplers; // one per table
+    bounded_sampler swap;
+    fnd::vector<char32_t> buf;
+};
+//------------------------------------------------------------------------------
+/** Generates one token of @p tpl into @p out, like gen_from_ranges().
+ */
+template <class Entropy, class Out>
+inline void gen_template(
+    const token_template &tpl,
+    template_state &st,
+    Entropy &src,
+    Out &out)
+{
+    constexpr uint32_t batch = 1024;
+    
+    for(const token_template::step &s : tpl.steps())
+    {
+        switch(s.what)
+        {
+        case token_template::op::literal:
+            for(uint32_t i = 0; i < s.count; i += batch)
+            {
+                const uint32_t n = s.count - i < batch ? s.count - i : batch;
+                std::memcpy(out.reserve(n), tpl.literals() + s.offset + i, n);
+                out.commit(n);
+            }
+            break;
+        case token_template::op::draw:
+            if(const ascii_kernel *kernel = tpl.kernel(s.table))
+                gen_ascii(*kernel, s.count, src, out);
+            else
+                gen_from_ranges(tpl.table(s.table), st.samplers[s.table],
+                    s.count, src, out);
+            break;
+        case token_template::op::collect:
+            {
+                RSTR_STAGE(select, s.count);
+                const symbol_table &tab = tpl.table(s.table);
+                index_sampler &sampler = st.samplers[s.table];
+                for(uint32_t i = 0; i < s.count; ++i)
+                    st.buf.push_back(tab[sampler(src)]);
+            }
+            break;
+        case token_template::op::shuffle:
+            {
+                char32_t *c = st.buf.data();
+                {
+                    // Fisher-Yates, the characters were counted already.
+                    RSTR_STAGE(select, 0);
+                    for(uint32_t i = s.count - 1; 0 != i; --i)
+                        std::swap(c[i], c[st.swap(src, i + 1)]);
+                }
+                RSTR_STAGE(encode, s.count);
+                for(uint32_t i = 0; i < s.count; i += batch)
+                {
+                    const uint32_t n =
+                        s.count - i < batch ? s.count - i : batch;
+                    char *const beg = out.reserve(4 * n);
+                    char *p = beg;
+                    for(uint32_t j = i; j < i + n; ++j)
+                        p += encode_utf8(c[j], p);
+                    out.commit(p - beg);
+                }
+                secure_zero(c, s.count * sizeof(char32_t));
+                st.buf.clear();
+            }
+            break;
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+/** Initializes Nebula.Crypt unless it already is, see release_crypt().
+ * Thread-safe.
+ */
+void acquire_crypt();
+/** Shuts Nebula.Crypt down once every acquire_crypt() has been matched.
+ */
+void release_crypt() noexcept;
+//------------------------------------------------------------------------------
+inline const char *to_cstr(const random_mode rndmode) noexcept
+{
+    switch(rndmode)
+    {
+    case random_mode::strong: return "strong";
+    case random_mode::very_strong: return "very-strong";
+    case random_mode::crypt_strong: return "crypt-strong";
+    case random_mode::crypt_very_strong: return "crypt-very-strong";
+    case random_mode::fast_crypt: return "fast-crypt";
+    default: return "unknown";
+    }
+}
+//------------------------------------------------------------------------------
+/** @return True for the modes that drain the system's entropy pool, which
+ *  have to stick to the frugal index_sampler.
+ */
+inline bool drains_entropy(const random_mode rndmode) noexcept
+{
+    return random_mode::very_strong == rndmode
+        || random_mode::crypt_very_strong == rndmode;
+}
+//------------------------------------------------------------------------------
+/** Constructs a new random device selected by @p rndmode and passes it to
+ * @p f. Nebula.Crypt must be acquired for the crypt modes.
+ */
+template <class F>
+inline void with_device(const random_mode rndmode, F &&f)
+{
+    switch(rndmode)
+    {
+    case random_mode::strong:
+        {
+            fnd::random::pseudo_random_device rnd;
+            f(rnd);
+        }
+        break;
+    case random_mode::very_strong:
+        {
+            fnd::random::random_device rnd;
+            f(rnd);
+        }
+        break;
+    case random_mode::crypt_strong:
+        {
+            ncrypt::pseudo_random_device rnd;
+            f(rnd);
+        }
+        break;
+    case random_mode::crypt_very_strong:
+        {
+            ncrypt::random_device rnd;
+            f(rnd);
+        }
+        break;
+    case random_mode::fast_crypt:
+        {
+            chacha20_device rnd;
+            f(rnd);
+        }
+        break;
+    default:
+        n_throw(logic_error);
+    }
+}
+
+#endif // RSTR_CORE_H
@@ -0,0 +1,354 @@
+/*--!>
+This file is part of 'rstr', a simple random string generator written in C++.
+
+Copyright 2016 outshined (outshined@riseup.net)
+    (PGP: 0x8A80C12396A4836F82A93FA79CA3D0F7E8FBCED6)
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, either version 3 of the
+License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+--------------------------------------------------------------------------<!--*/
+#include "rstr.h"
+#include "core.h"
+
+#include <nebula/foundation/scope_exit.h>
+
+#include <atomic>
+#include <system_error>
+
+#include <pthread.h>
+
+namespace rstr {
+
+//------------------------------------------------------------------------------
+struct charset::impl
+{
+    explicit impl(const fnd::vector<fnd::array<char32_t, 2>> &ranges)
+    : tab(ranges), sampler(tab.size())
+    {
+        if(ascii_kernel::supports(tab))
+            kernel = ascii_kernel(tab);
+    }
+    
+    symbol_table tab;
+    index_sampler sampler; // copied by the rng states that need one
+    fnd::optional<ascii_kernel> kernel;
+};
+
+//------------------------------------------------------------------------------
+charset::charset(std::unique_ptr<impl> p) noexcept
+: impl_(std::move(p))
+{}
+charset::charset(const range *ranges, const size_t count)
+{
+    if(0 == count)
+        throw std::invalid_argument("rstr::charset: No ranges.");
+    
+    fnd::vector<fnd::array<char32_t, 2>> v;
+    v.reserve(count);
+    for(size_t i = 0; i < count; ++i)
+    {
+        if(ranges[i].first >= ranges[i].last || ranges[i].last > 0x110000)
+            throw std::invalid_argument("rstr::charset: Invalid range.");
+        if(ranges[i].first < 0xE000 && ranges[i].last > 0xD800)
+            throw std::invalid_argument("rstr::charset: Range covers surrogates.");
+        v.push_back(fnd::array<char32_t, 2>{ranges[i].first, ranges[i].last});
+    }
+    normalize_ranges(v, false);
+    impl_.reset(new impl(v));
+}
+charset::charset(charset &&) noexcept = default;
+charset &charset::operator=(charset &&) noexcept = default;
+charset::~charset() = default;
+//------------------------------------------------------------------------------
+charset charset::parse(const char *config, const size_t size)
+{
+    fnd::vector<fnd::array<char32_t, 2>> v;
+    errc err;
+    size_t pos;
+    fnd::tie(err, pos) = parse_config(
+        fnd::const_cstring(config, config + size), v);
+    if(errc::success != err)
+    {
+        const fnd::string msg = fnd::system::error_code(err).message();
+        throw parse_error(std::string(msg.data(), msg.size()), pos);
+    }
+    if(v.empty())
+        throw parse_error("Empty config.", 0);
+    normalize_ranges(v, false);
+    
+    return charset(std::unique_ptr<impl>(new impl(v)));
+}
+charset charset::parse(const std::string &config)
+{
+    return parse(config.data(), config.size());
+}
+//------------------------------------------------------------------------------
+size_t charset::size() const noexcept
+{
+    return size_t(impl_->tab.size());
+}
+size_t charset::max_char_size() const noexcept
+{
+    return impl_->tab.ascii() ? 1 : 4;
+}
+
+//------------------------------------------------------------------------------
+namespace {
+
+/** Writes straight to the caller's memory, except for the last batch of a
+ * generator, which may reserve more than it needs and goes through the
+ * stack.
+ */
+class span_sink
+{
+public:
+    span_sink(char *dst, const size_t size) noexcept
+    : p_(dst), end_(dst + size)
+    {}
+    span_sink(const span_sink &) = delete;
+    span_sink &operator=(const span_sink &) = delete;
+    
+    ~span_sink()
+    {
+        if(used_scratch_)
+            secure_zero(scratch_, sizeof(scratch_));
+    }
+    
+    inline char *reserve(const size_t n)
+    {
+        in_scratch_ = size_t(end_ - p_) < n;
+        if(!in_scratch_)
+            return p_;
+        if(n > sizeof(scratch_))
+            n_throw(logic_error);
+        used_scratch_ = true;
+        return scratch_;
+    }
+    inline void commit(const size_t n) noexcept
+    {
+        if(in_scratch_)
+            std::memcpy(p_, scratch_, n);
+        p_ += n;
+    }
+    
+    inline char *position() const noexcept {
+        return p_;
+    }
+    
+private:
+    // gen_ascii() reserves up to 4096 + 8 bytes, gen_from_ranges() 4 * 1024
+    // or 1024 for ASCII.
+    static constexpr size_t scratch_size = 4096 + 8;
+    
+    char *p_;
+    char *end_;
+    bool in_scratch_ = false;
+    bool used_scratch_ = false;
+    char scratch_[scratch_size];
+};
+
+} // anonymous
+
+//------------------------------------------------------------------------------
+struct rng::state
+{
+    virtual ~state() = default;
+    
+    /** The value of forks() when the state was made.
+     */
+    unsigned generation = 0;
+    
+    virtual void generate(
+        const charset::impl &cs,
+        const size_t length,
+        span_sink &out) = 0;
+};
+
+namespace {
+
+//------------------------------------------------------------------------------
+std::atomic<unsigned> fork_count{0};
+std::once_flag fork_hook;
+
+void count_fork() noexcept
+{
+    fork_count.fetch_add(1, std::memory_order_relaxed);
+}
+/** @return The number of fork()s on the way from the first rng to the
+ *  calling process.
+ */
+inline unsigned forks() noexcept
+{
+    return fork_count.load(std::memory_order_relaxed);
+}
+
+//------------------------------------------------------------------------------
+template <class Rnd>
+class device_state : public rng::state
+{
+public:
+    device_state(const size_t block_size, const bool allow_kernel)
+    : src_(rnd_, block_size), allow_kernel_(allow_kernel)
+    {}
+    
+    void generate(
+        const charset::impl &cs,
+        const size_t length,
+        span_sink &out) override
+    {
+        if(allow_kernel_ && cs.kernel.valid())
+            gen_ascii(cs.kernel.get(), length, src_, out);
+        else
+        {
+            // The digits left in a sampler fit any alphabet of its size, so
+            // they carry over to the next call instead of being dropped.
+            if(!sampler_.valid() || sampler_.get().size() != cs.tab.size())
+                sampler_ = cs.sampler;
+            gen_from_ranges(cs.tab, sampler_.get(), length, src_, out);
+        }
+    }
+    
+private:
+    Rnd rnd_;
+    block_entropy<Rnd> src_;
+    bool allow_kernel_;
+    fnd::optional<index_sampler> sampler_;
+};
+
+//------------------------------------------------------------------------------
+inline random_mode to_random_mode(const rng_mode mode)
+{
+    switch(mode)
+    {
+    case rng_mode::strong: return random_mode::strong;
+    case rng_mode::very_strong: return random_mode::very_strong;
+    case rng_mode::crypt_strong: return random_mode::crypt_strong;
+    case rng_mode::crypt_very_strong: return random_mode::crypt_very_strong;
+    case rng_mode::fast_crypt: return random_mode::fast_crypt;
+    default: throw std::invalid_argument("rstr::rng: Invalid mode.");
+    }
+}
+//------------------------------------------------------------------------------
+inline bool needs_crypt(const rng_mode mode) noexcept
+{
+    return rng_mode::crypt_strong == mode
+        || rng_mode::crypt_very_strong == mode
+        || rng_mode::fast_crypt == mode;
+}
+//------------------------------------------------------------------------------
+/** The counterpart of with_device() for devices that outlive the call.
+ */
+rng::state *make_state(const rng_mode mode, const size_t block_size)
+{
+    const random_mode rndmode = to_random_mode(mode);
+    const bool allow_kernel = !drains_entropy(rndmode);
+    
+    switch(rndmode)
+    {
+    case random_mode::strong:
+        return new device_state<fnd::random::pseudo_random_device>(
+            block_size, allow_kernel);
+    case random_mode::very_strong:
+        return new device_state<fnd::random::random_device>(
+            block_size, allow_kernel);
+    case random_mode::crypt_strong:
+        return new device_state<ncrypt::pseudo_random_device>(
+            block_size, allow_kernel);
+    case random_mode::crypt_very_strong:
+        return new device_state<ncrypt::random_device>(
+            block_size, allow_kernel);
+    case random_mode::fast_crypt:
+        return new device_state<chacha20_device>(
+            block_size, allow_kernel);
+    default:
+        n_throw(logic_error);
+    }
+}
+
+} // anonymous
+
+//------------------------------------------------------------------------------
+rng::rng(const rng_mode mode, const size_t block_size)
+: mode_(mode), block_size_(block_size)
+{
+    to_random_mode(mode); // validates
+    std::call_once(fork_hook, [] {
+        const int e = ::pthread_atfork(nullptr, nullptr, count_fork);
+        if(0 != e)
+            throw std::system_error(std::error_code(e, std::system_category()));
+    });
+    if(needs_crypt(mode_))
+        acquire_crypt();
+}
+rng::~rng()
+{
+    // The devices have to go before Nebula.Crypt.
+    states_.clear();
+    if(needs_crypt(mode_))
+        release_crypt();
+}
+//------------------------------------------------------------------------------
+rng::state *rng::acquire()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_);
+        while(!idle_.empty())
+        {
+            state *s = idle_.back();
+            idle_.pop_back();
+            if(s->generation == forks())
+                return s;
+            
+            // Made before a fork(), so the parent and every other child
+            // hold the same keys and buffered entropy.
+            for(auto i = states_.begin(); i != states_.end(); ++i)
+                if(i->get() == s)
+                {
+                    states_.erase(i);
+                    break;
+                }
+        }
+    }
+    
+    // Constructing a device may block for a while, so not under the lock.
+    std::unique_ptr<state> s(make_state(mode_, block_size_));
+    s->generation = forks();
+    std::lock_guard<std::mutex> lock(m_);
+    states_.push_back(std::move(s));
+    // Makes sure release() never has to allocate.
+    idle_.reserve(states_.size());
+    return states_.back().get();
+}
+void rng::release(state *s) noexcept
+{
+    std::lock_guard<std::mutex> lock(m_);
+    idle_.push_back(s);
+}
+
+//------------------------------------------------------------------------------
+size_t generate(const charset &cs, rng &r, char *dst, const size_t n)
+{
+    if(0 == n)
+        return 0;
+    
+    rng::state *s = r.acquire();
+    n_scope_exit() {
+        r.release(s);
+    };
+    
+    span_sink out(dst, n * cs.max_char_size());
+    s->generate(*cs.impl_, n, out);
+    return size_t(out.position() - dst);
+}
+
+} // rstr
@@ -0,0 +1,183 @@
+/*--!>
+This file is part of 'rstr', a simple random string generator written in C++.
+
+Copyright 2016 outshined (outshined@riseup.net)
+    (PGP: 0x8A80C12396A4836F82A93FA79CA3D0F7E8FBCED6)
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, either version 3 of the
+License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+--------------------------------------------------------------------------<!--*/
+#ifndef RSTR_RSTR_H
+#define RSTR_RSTR_H
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/** Exports a declaration from librstr, which hides everything else.
+ */
+#if defined(__GNUC__)
+#   define RSTR_API __attribute__((visibility("default")))
+#else
+#   define RSTR_API
+#endif
+
+/** The random string generator of rstr as a library.
+ *
+ * A charset is compiled once, e.g. from a config like "(a z)(0 9)", and can
+ * then be shared by any number of threads. An rng is a thread-safe handle
+ * to random devices of one mode. generate() combines both and doesn't
+ * allocate once every thread using an rng has called it once.
+ */
+namespace rstr {
+
+//------------------------------------------------------------------------------
+/** The characters [first, last).
+ */
+struct range
+{
+    char32_t first;
+    char32_t last;
+};
+
+//------------------------------------------------------------------------------
+/** Thrown by charset::parse().
+ */
+class RSTR_API parse_error : public std::runtime_error
+{
+public:
+    parse_error(const std::string &what, const size_t position)
+    : std::runtime_error(what), position_(position)
+    {}
+    
+    /** @return The byte offset of the error in the config.
+     */
+    inline size_t position() const noexcept {
+        return position_;
+    }
+    
+private:
+    size_t position_;
+};
+
+class rng;
+
+//------------------------------------------------------------------------------
+/** A compiled alphabet, immutable and safe to share between threads.
+ */
+class RSTR_API charset
+{
+public:
+    /** @throw std::invalid_argument If there are no ranges or one of them is
+     *  empty, goes beyond U+10FFFF or overlaps the surrogates U+D800..U+DFFF.
+     */
+    charset(const range *ranges, size_t count);
+    charset(charset &&) noexcept;
+    charset &operator=(charset &&) noexcept;
+    ~charset();
+    
+    /** Compiles a config in the syntax of the command line.
+     * @throw parse_error
+     */
+    static charset parse(const char *config, size_t size);
+    static charset parse(const std::string &config);
+    
+    /** @return The number of characters, counting duplicates.
+     */
+    size_t size() const noexcept;
+    /** @return The maximum number of bytes of a character, 1 if all of them
+     *  are ASCII and 4 otherwise.
+     */
+    size_t max_char_size() const noexcept;
+    
+    struct impl;
+    
+private:
+    friend size_t generate(const charset &, rng &, char *, size_t);
+    
+    explicit charset(std::unique_ptr<impl> p) noexcept;
+    
+    std::unique_ptr<impl> impl_;
+};
+
+//------------------------------------------------------------------------------
+/** Same as the --random option.
+ */
+enum class rng_mode
+{
+    strong,
+    very_strong,
+    crypt_strong,
+    crypt_very_strong,
+    fast_crypt
+};
+
+//------------------------------------------------------------------------------
+/** A thread-safe handle to random devices.
+ *
+ * Every thread calling generate() concurrently gets a device and a block
+ * buffer of its own, which are kept for reuse afterwards.
+ *
+ * An rng may be made before fork()ing workers: a child never reuses the
+ * devices and buffers of its parent but makes and seeds its own, so no two
+ * processes produce the same strings. Fork only while no other thread is
+ * inside generate().
+ */
+class RSTR_API rng
+{
+public:
+    /** @param block_size The number of bytes read from a device at once,
+     *  like --block-size.
+     */
+    explicit rng(rng_mode mode = rng_mode::fast_crypt,
+        size_t block_size = 4096);
+    rng(const rng &) = delete;
+    rng &operator=(const rng &) = delete;
+    ~rng();
+    
+    inline rng_mode mode() const noexcept {
+        return mode_;
+    }
+    
+    struct state;
+    
+private:
+    friend size_t generate(const charset &, rng &, char *, size_t);
+    
+    state *acquire();
+    void release(state *s) noexcept;
+    
+    rng_mode mode_;
+    size_t block_size_;
+    std::mutex m_;
+    std::vector<std::unique_ptr<state>> states_;
+    std::vector<state *> idle_;
+};
+
+//------------------------------------------------------------------------------
+/** Writes @p n random characters of @p cs to @p dst, which must have room
+ * for n * cs.max_char_size() bytes. Thread-safe.
+ *
+ * Like the command line, the very-strong modes spend only about log2 of the
+ * charset's size bits of entropy per character.
+ * @return The number of bytes written.
+ */
+RSTR_API size_t generate(
+    const charset &cs, rng &r, char *dst, size_t n);
+
+} // rstr
+
+#endif // RSTR_RSTR_H
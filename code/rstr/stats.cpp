@@ -0,0 +1,84 @@
+/*--!>
+This file is part of 'rstr', a simple random string generator written in C++.
+
+Copyright 2016 outshined (outshined@riseup.net)
+    (PGP: 0x8A80C12396A4836F82A93FA79CA3D0F7E8FBCED6)
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, either version 3 of the
+License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+--------------------------------------------------------------------------<!--*/
+#include "core.h"
+
+#ifdef RSTR_STATS
+
+#include <atomic>
+
+namespace {
+
+//------------------------------------------------------------------------------
+struct stage_counter
+{
+    std::atomic<uint64_t> ticks{0};
+    std::atomic<uint64_t> calls{0};
+    std::atomic<uint64_t> bytes{0};
+};
+
+stage_counter counters[stage_count];
+uint64_t start_ticks = 0;
+chrono::steady_clock::time_point start_time;
+
+} // anonymous
+
+bool stats_enabled = false;
+thread_local uint64_t stage_timer::nested_ = 0;
+
+//------------------------------------------------------------------------------
+void enable_stats()
+{
+    start_time = chrono::steady_clock::now();
+    start_ticks = stats_ticks();
+    stats_enabled = true;
+}
+//------------------------------------------------------------------------------
+void add_stage(const stage s, const uint64_t ticks, const uint64_t bytes)
+    noexcept
+{
+    stage_counter &c = counters[size_t(s)];
+    c.ticks.fetch_add(ticks, std::memory_order_relaxed);
+    c.calls.fetch_add(1, std::memory_order_relaxed);
+    c.bytes.fetch_add(bytes, std::memory_order_relaxed);
+}
+//------------------------------------------------------------------------------
+stage_totals read_stats(const stage s) noexcept
+{
+    const stage_counter &c = counters[size_t(s)];
+    stage_totals r;
+    r.ticks = c.ticks.load(std::memory_order_relaxed);
+    r.calls = c.calls.load(std::memory_order_relaxed);
+    r.bytes = c.bytes.load(std::memory_order_relaxed);
+    return r;
+}
+//------------------------------------------------------------------------------
+double stats_seconds()
+{
+    return chrono::duration_cast<chrono::duration<double>>(
+        chrono::steady_clock::now() - start_time).count();
+}
+double stats_tick_rate()
+{
+    const uint64_t ticks = stats_ticks() - start_ticks;
+    const double seconds = stats_seconds();
+    return seconds > 0 ? double(ticks) / seconds : 1e9;
+}
+
+#endif // RSTR_STATS
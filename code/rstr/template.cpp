@@ -0,0 +1,128 @@
+/*--!>
+This file is part of 'rstr', a simple random string generator written in C++.
+
+Copyright 2016 outshined (outshined@riseup.net)
+    (PGP: 0x8A80C12396A4836F82A93FA79CA3D0F7E8FBCED6)
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, either version 3 of the
+License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+--------------------------------------------------------------------------<!--*/
+#include "core.h"
+
+static_assert(token_template::max_count <= bounded_sampler::max_bound,
+    "Groups are shuffled using bounded_sampler.");
+
+//------------------------------------------------------------------------------
+void token_template::add_literal(const fnd::const_cstring s)
+{
+    if(s.empty())
+        return;
+    if(uint64_t(literals_.size()) + s.size() > 0xFFFFFFFF)
+        n_throw(logic_error);
+    
+    // Neighbouring literals are one step.
+    if(!steps_.empty() && op::literal == steps_.back().what)
+        steps_.back().count += uint32_t(s.size());
+    else
+        steps_.push_back(step{op::literal, 0,
+            uint32_t(s.size()), uint32_t(literals_.size())});
+    literals_.insert(literals_.end(), s.begin(), s.end());
+    max_size_ += s.size();
+}
+//------------------------------------------------------------------------------
+void token_template::add_group(
+    const fnd::vector<fnd::array<char32_t, 2>> &ranges,
+    const uint32_t count,
+    const fnd::vector<requirement> &at_least)
+{
+    if(0 == count || count > max_count)
+        n_throw(logic_error);
+    
+    const auto max_bytes = [this] (const uint32_t table, const uint32_t n) {
+        max_size_ += uint64_t(n) * (tables_[table].ascii() ? 1 : 4);
+    };
+    
+    length_ += count;
+    if(at_least.empty())
+    {
+        const uint32_t t = add_table(ranges);
+        max_bytes(t, count);
+        // So does a group following one of the same characters.
+        if(!steps_.empty() && op::draw == steps_.back().what
+            && t == steps_.back().table)
+            steps_.back().count += count;
+        else
+            steps_.push_back(step{op::draw, t, count, 0});
+        return;
+    }
+    
+    uint32_t rest = count;
+    for(const requirement &r : at_least)
+    {
+        if(0 == r.count || r.count > rest)
+            n_throw(logic_error);
+        const uint32_t t = add_table(r.ranges);
+        max_bytes(t, r.count);
+        steps_.push_back(step{op::collect, t, r.count, 0});
+        rest -= r.count;
+    }
+    if(0 != rest)
+    {
+        const uint32_t t = add_table(ranges);
+        max_bytes(t, rest);
+        steps_.push_back(step{op::collect, t, rest, 0});
+    }
+    steps_.push_back(step{op::shuffle, 0, count, 0});
+    if(count > max_shuffle_)
+        max_shuffle_ = count;
+}
+//------------------------------------------------------------------------------
+size_t token_template::use_kernels()
+{
+    size_t n = 0;
+    kernels_.clear();
+    kernels_.resize(tables_.size());
+    for(size_t i = 0; i < tables_.size(); ++i)
+        if(ascii_kernel::supports(tables_[i]))
+        {
+            kernels_[i] = ascii_kernel(tables_[i]);
+            ++n;
+        }
+    return n;
+}
+//------------------------------------------------------------------------------
+uint32_t token_template::add_table(
+    const fnd::vector<fnd::array<char32_t, 2>> &ranges)
+{
+    for(size_t i = 0; i < table_ranges_.size(); ++i)
+        if(table_ranges_[i] == ranges)
+            return uint32_t(i);
+    
+    tables_.emplace_back(ranges);
+    table_ranges_.push_back(ranges);
+    return uint32_t(tables_.size() - 1);
+}
+
+//------------------------------------------------------------------------------
+template_state::template_state(const token_template &tpl)
+{
+    samplers.reserve(tpl.tables());
+    for(size_t i = 0; i < tpl.tables(); ++i)
+        samplers.emplace_back(tpl.table(i).size());
+    buf.reserve(tpl.max_shuffle());
+}
+template_state::~template_state()
+{
+    // Only the characters of an unfinished token could be left.
+    secure_zero(buf.data(), buf.size() * sizeof(char32_t));
+}
@@ -0,0 +1,140 @@
+/*--!>
+This file is part of 'rstr', a simple random string generator written in C++.
+
+Copyright 2016 outshined (outshined@riseup.net)
+    (PGP: 0x8A80C12396A4836F82A93FA79CA3D0F7E8FBCED6)
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, either version 3 of the
+License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+--------------------------------------------------------------------------<!--*/
+#include "core.h"
+
+#include <algorithm>
+
+namespace {
+
+//------------------------------------------------------------------------------
+struct unicode_name
+{
+    const char *name;
+    uint32_t value;
+};
+
+#include "unicode_table.inc"
+
+constexpr size_t unicode_run_count =
+    sizeof(unicode_runs) / sizeof(unicode_runs[0]);
+static_assert(unicode_run_count
+    == sizeof(unicode_run_scripts) / sizeof(unicode_run_scripts[0]),
+    "unicode_table.inc is broken.");
+
+//------------------------------------------------------------------------------
+inline char32_t run_first(const size_t i) noexcept {
+    return unicode_run_count == i ?
+        0x110000 : char32_t(unicode_runs[i] & 0x1FFFFF);
+}
+inline unsigned run_category(const size_t i) noexcept {
+    return unicode_runs[i] >> 21;
+}
+//------------------------------------------------------------------------------
+/** Turns @p s into the loose form of UAX #44: lower case, without spaces,
+ * hyphens and underscores.
+ * @return False if it doesn't fit into @p buf.
+ */
+template <size_t N>
+inline bool loose_name(const fnd::const_cstring s, char (&buf)[N]) noexcept
+{
+    size_t n = 0;
+    for(const char c : s)
+    {
+        if(' ' == c || '-' == c || '_' == c)
+            continue;
+        if(N - 1 == n)
+            return false;
+        buf[n++] = 'A' <= c && c <= 'Z' ? char(c - 'A' + 'a') : c;
+    }
+    buf[n] = 0;
+    return true;
+}
+//------------------------------------------------------------------------------
+template <size_t N>
+inline const unicode_name *find_name(
+    const unicode_name (&names)[N], const fnd::const_cstring s) noexcept
+{
+    char buf[64];
+    if(!loose_name(s, buf))
+        return nullptr;
+    const unicode_name *i = std::lower_bound(names, names + N, buf,
+        [] (const unicode_name &x, const char *y) {
+            return std::strcmp(x.name, y) < 0;
+        });
+    return names + N != i && 0 == std::strcmp(i->name, buf) ? i : nullptr;
+}
+//------------------------------------------------------------------------------
+/** Appends the runs for which @p pred is true, merging neighbours.
+ */
+template <class Pred>
+inline void append_runs(Pred pred, fnd::vector<fnd::array<char32_t, 2>> &v)
+{
+    bool open = false;
+    for(size_t i = 0; i < unicode_run_count; ++i)
+    {
+        if(!pred(i))
+        {
+            open = false;
+            continue;
+        }
+        if(open)
+            v.back()[1] = run_first(i + 1);
+        else
+            v.emplace_back(fnd::array<char32_t, 2>{
+                run_first(i), run_first(i + 1)});
+        open = true;
+    }
+}
+
+} // anonymous
+
+//------------------------------------------------------------------------------
+bool unicode_class(
+    const fnd::const_cstring name,
+    fnd::vector<fnd::array<char32_t, 2>> &v)
+{
+    const unicode_name *n = find_name(unicode_class_names, name);
+    if(!n)
+        return false;
+    // Surrogates and unassigned code points aren't characters, not even
+    // for (class C) or (class Cs).
+    static const uint32_t never = find_name(unicode_class_names, "Cs")->value
+        | find_name(unicode_class_names, "Cn")->value;
+    const uint32_t mask = n->value & ~never;
+    append_runs([mask] (const size_t i) {
+            return 0 != (mask & (uint32_t(1) << run_category(i)));
+        }, v);
+    return true;
+}
+//------------------------------------------------------------------------------
+bool unicode_script(
+    const fnd::const_cstring name,
+    fnd::vector<fnd::array<char32_t, 2>> &v)
+{
+    const unicode_name *n = find_name(unicode_script_names, name);
+    if(!n)
+        return false;
+    const uint32_t script = n->value;
+    // Only assigned characters, Unknown would be mostly Cn otherwise.
+    append_runs([script] (const size_t i) {
+            return unicode_run_scripts[i] == script && 0 != run_category(i);
+        }, v);
+    return true;
+}
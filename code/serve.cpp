@@ -0,0 +1,1394 @@
+/*--!>
+This file is part of 'rstr', a simple random string generator written in C++.
+
+Copyright 2016 outshined (outshined@riseup.net)
+    (PGP: 0x8A80C12396A4836F82A93FA79CA3D0F7E8FBCED6)
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, either version 3 of the
+License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+--------------------------------------------------------------------------<!--*/
+#include "serve.h"
+#include "bench.h"
+
+#include <nebula/foundation/scope_exit.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#   include <sys/epoll.h>
+#   include <sys/signalfd.h>
+#endif
+
+namespace {
+
+//------------------------------------------------------------------------------
+/** An alphabet with everything needed to generate strings from it, so it can
+ * be kept around and reused.
+ */
+class token_profile
+{
+public:
+    /** @param allow_kernel Whether an ascii_kernel may be used, which it
+     *  must not in the very-strong modes.
+     */
+    token_profile(
+        const fnd::vector<fnd::array<char32_t, 2>> &ranges,
+        const bool allow_kernel)
+    : tab_(ranges), sampler_(tab_.size())
+    {
+        if(allow_kernel && ascii_kernel::supports(tab_))
+            kernel_ = ascii_kernel(tab_);
+    }
+    token_profile(const token_profile &) = delete;
+    token_profile &operator=(const token_profile &) = delete;
+    
+    template <class Entropy, class Out>
+    inline void operator () (const size_t length, Entropy &src, Out &out)
+    {
+        if(kernel_.valid())
+            gen_ascii(kernel_.get(), length, src, out);
+        else
+            gen_from_ranges(tab_, sampler_, length, src, out);
+    }
+    
+    /** @return The maximum number of bytes of a character.
+     */
+    inline size_t max_char_size() const noexcept {
+        return tab_.ascii() ? 1 : 4;
+    }
+    
+private:
+    symbol_table tab_;
+    index_sampler sampler_;
+    fnd::optional<ascii_kernel> kernel_;
+};
+
+//------------------------------------------------------------------------------
+/** A bounded ring of ready-made strings of one alphabet and length, filled
+ * by one thread and emptied by another without locking.
+ *
+ * The strings live in locked memory and are wiped as soon as they have been
+ * handed out.
+ */
+class token_pool
+{
+public:
+    /** @return The number of bytes needed for @p capacity strings of
+     *  @p length characters, or 0 if that doesn't fit into a size_t.
+     */
+    static size_t memory_size(
+        const size_t length,
+        const size_t max_char_size,
+        const size_t capacity) noexcept
+    {
+        const size_t stride = length * max_char_size + 1;
+        if(0 == capacity || length > size_t(-1) / 8
+            || stride > size_t(-1) / capacity)
+            return 0;
+        return stride * capacity;
+    }
+    
+    token_pool(
+        fnd::string config,
+        const fnd::vector<fnd::array<char32_t, 2>> &ranges,
+        const bool allow_kernel,
+        const size_t length,
+        const delimiter_mode delim,
+        const size_t capacity,
+        const size_t low_water)
+    : config_(fnd::move(config)), prof_(ranges, allow_kernel),
+        length_(length), delim_(delim),
+        stride_(length * prof_.max_char_size() + 1),
+        capacity_(capacity), low_water_(low_water),
+        sizes_(capacity),
+        mem_(memory_size(length, prof_.max_char_size(), capacity))
+    {
+        // Nothing is ever below a low-water mark of 0.
+        if(0 == length || 0 == low_water || low_water > capacity)
+            n_throw(logic_error);
+        
+        if(0 != ::mlock(mem_.data(), mem_.size()))
+            gl->warning("Unable to lock a token pool of ", mem_.size(),
+                " bytes in memory: ", std::strerror(errno));
+#ifdef MADV_DONTDUMP
+        ::madvise(mem_.data(), mem_.size(), MADV_DONTDUMP);
+#endif
+    }
+    token_pool(const token_pool &) = delete;
+    token_pool &operator=(const token_pool &) = delete;
+    
+    inline const fnd::string &config() const noexcept {
+        return config_;
+    }
+    inline size_t length() const noexcept {
+        return length_;
+    }
+    
+    /** Moves up to @p n strings to @p out. Consumer only.
+     * @return The number of strings moved.
+     */
+    size_t take(const size_t n, chunk_buffer &out)
+    {
+        const uint64_t head = head_.load(std::memory_order_relaxed);
+        const uint64_t tail = tail_.load(std::memory_order_acquire);
+        const size_t k = tail - head < n ? size_t(tail - head) : n;
+        
+        for(size_t i = 0; i < k; ++i)
+        {
+            const size_t slot = size_t((head + i) % capacity_);
+            char *const p = mem_.data() + slot * stride_;
+            const size_t size = sizes_[slot];
+            std::memcpy(out.reserve(size), p, size);
+            out.commit(size);
+            secure_zero(p, size);
+        }
+        head_.store(head + k, std::memory_order_release);
+        
+        hits_.store(hits_.load(std::memory_order_relaxed) + k,
+            std::memory_order_relaxed);
+        misses_.store(misses_.load(std::memory_order_relaxed) + (n - k),
+            std::memory_order_relaxed);
+        return k;
+    }
+    
+    /** @return True if the pool is below its low-water mark. Consumer only;
+     *  only returns true once until rearm() has been called.
+     */
+    inline bool wants_refill() noexcept
+    {
+        return depth() < low_water_
+            && !refill_wanted_.exchange(true, std::memory_order_relaxed);
+    }
+    /** Producer only, to be called before looking at depth().
+     */
+    inline void rearm() noexcept {
+        refill_wanted_.store(false, std::memory_order_relaxed);
+    }
+    
+    /** Fills the pool up to its capacity. Producer only.
+     * @param scratch Holds a string while it is generated.
+     */
+    template <class Entropy>
+    void refill(Entropy &src, chunk_buffer &scratch)
+    {
+        uint64_t tail = tail_.load(std::memory_order_relaxed);
+        uint64_t generated = 0;
+        while(tail - head_.load(std::memory_order_acquire) < capacity_)
+        {
+            const size_t slot = size_t(tail % capacity_);
+            prof_(length_, src, scratch);
+            put_delimiter(delim_, scratch);
+            std::memcpy(mem_.data() + slot * stride_, scratch.data(),
+                scratch.size());
+            sizes_[slot] = scratch.size();
+            scratch.wipe();
+            
+            tail_.store(++tail, std::memory_order_release);
+            ++generated;
+        }
+        
+        if(0 != generated)
+        {
+            generated_.store(generated_.load(std::memory_order_relaxed)
+                + generated, std::memory_order_relaxed);
+            refills_.store(refills_.load(std::memory_order_relaxed) + 1,
+                std::memory_order_relaxed);
+        }
+    }
+    
+    /** @return The number of strings ready. */
+    inline size_t depth() const noexcept {
+        return size_t(tail_.load(std::memory_order_acquire)
+            - head_.load(std::memory_order_acquire));
+    }
+    inline size_t capacity() const noexcept {
+        return capacity_;
+    }
+    inline size_t low_water() const noexcept {
+        return low_water_;
+    }
+    /** @return The number of strings handed out from the pool. */
+    inline uint64_t hits() const noexcept {
+        return hits_.load(std::memory_order_relaxed);
+    }
+    /** @return The number of strings asked for while the pool was empty. */
+    inline uint64_t misses() const noexcept {
+        return misses_.load(std::memory_order_relaxed);
+    }
+    inline uint64_t generated() const noexcept {
+        return generated_.load(std::memory_order_relaxed);
+    }
+    inline uint64_t refills() const noexcept {
+        return refills_.load(std::memory_order_relaxed);
+    }
+    
+private:
+    fnd::string config_;
+    token_profile prof_;
+    size_t length_;
+    delimiter_mode delim_;
+    size_t stride_;
+    size_t capacity_;
+    size_t low_water_;
+    fnd::vector<size_t> sizes_;
+    page_buffer mem_;
+    
+    // Consumer and producer side, kept apart so they don't fight over a
+    // cache line.
+    std::atomic<uint64_t> head_{0};
+    std::atomic<uint64_t> hits_{0};
+    std::atomic<uint64_t> misses_{0};
+    std::atomic<bool> refill_wanted_{false};
+    char pad_[64];
+    std::atomic<uint64_t> tail_{0};
+    std::atomic<uint64_t> generated_{0};
+    std::atomic<uint64_t> refills_{0};
+};
+//------------------------------------------------------------------------------
+/** The token_pools of a server together with the thread refilling them.
+ *
+ * The refill thread has a random device of its own and sleeps until a pool
+ * drops below its low-water mark.
+ *
+ * Must be used within with_random_mode().
+ */
+class token_pool_set
+{
+public:
+    static constexpr size_t max_pools = 64;
+    static constexpr size_t max_memory = size_t(256) << 20; // per pool
+    static constexpr size_t max_total_memory = size_t(1) << 30;
+    
+    token_pool_set(
+        const random_mode rndmode,
+        const size_t block_size,
+        const bool allow_kernel,
+        const delimiter_mode delim,
+        const size_t capacity,
+        const size_t low_water)
+    : allow_kernel_(allow_kernel), delim_(delim),
+        capacity_(capacity), low_water_(low_water)
+    {
+        if(0 == capacity || 0 == low_water || low_water > capacity)
+            n_throw(logic_error);
+        
+        thread_ = std::thread([this, rndmode, block_size] {
+            // Signals are for the thread running serve().
+            sigset_t sigs;
+            ::sigfillset(&sigs);
+            ::pthread_sigmask(SIG_BLOCK, &sigs, nullptr);
+            
+            try {
+                with_device(rndmode, [&] (auto &rnd) {
+                    this->run(make_block_entropy(rnd, block_size));
+                });
+            }
+            catch(...) {
+                gl->error("The token pools can't be refilled anymore.");
+                gl->debug(fnd::diagnostic_information(
+                    fnd::current_exception()));
+            }
+        });
+    }
+    token_pool_set(const token_pool_set &) = delete;
+    token_pool_set &operator=(const token_pool_set &) = delete;
+    
+    ~token_pool_set()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        thread_.join();
+    }
+    
+    /** @return The pool for @p length characters of @p config, which gets
+     *  created from @p ranges if needed, or null if there can't be one.
+     */
+    token_pool *find(
+        const fnd::const_cstring config,
+        const fnd::vector<fnd::array<char32_t, 2>> &ranges,
+        const size_t length)
+    {
+        for(auto &p : pools_)
+            if(p->length() == length && p->config().size() == config.size()
+                && 0 == std::memcmp(p->config().data(), config.data(),
+                    config.size()))
+                return p.get();
+        
+        if(max_pools == pools_.size() || 0 == length)
+            return nullptr;
+        // Clients pick the lengths and configs, so without a limit on the
+        // sum they could have max_pools of the largest ones locked.
+        const size_t mem = token_pool::memory_size(
+            length, 4, capacity_);
+        if(0 == mem || mem > max_memory || mem > max_total_memory - memory_)
+            return nullptr;
+        
+        std::unique_ptr<token_pool> p(new token_pool(
+            fnd::string(config.begin(), config.end()), ranges,
+            allow_kernel_, length, delim_, capacity_, low_water_));
+        token_pool *r = p.get();
+        {
+            std::lock_guard<std::mutex> lock(m_);
+            pools_.push_back(fnd::move(p));
+        }
+        memory_ += mem;
+        wake();
+        return r;
+    }
+    
+    /** Lets the refill thread look at the pools.
+     */
+    void wake()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_);
+            wanted_ = true;
+        }
+        cv_.notify_one();
+    }
+    
+    /** Appends a line of stats per pool to @p out.
+     */
+    void stats(chunk_buffer &out)
+    {
+        fnd::vector<token_pool *> pools;
+        {
+            std::lock_guard<std::mutex> lock(m_);
+            for(auto &p : pools_)
+                pools.push_back(p.get());
+        }
+        
+        io::msink<fnd::string> ss;
+        for(const token_pool *p : pools)
+            fmt::fwrite(ss,
+                "pool length=", p->length(),
+                " depth=", p->depth(),
+                " capacity=", p->capacity(),
+                " low-water=", p->low_water(),
+                " hits=", p->hits(),
+                " misses=", p->misses(),
+                " generated=", p->generated(),
+                " refills=", p->refills(),
+                " config=", p->config(), '\n');
+        const fnd::string &s = ss.container();
+        std::memcpy(out.reserve(s.size()), s.data(), s.size());
+        out.commit(s.size());
+    }
+    
+private:
+    template <class Entropy>
+    void run(Entropy src)
+    {
+        chunk_buffer scratch;
+        fnd::vector<token_pool *> pools;
+        while(true)
+        {
+            {
+                std::unique_lock<std::mutex> lock(m_);
+                cv_.wait(lock, [&] { return wanted_ || stop_; });
+                if(stop_)
+                    return;
+                wanted_ = false;
+                pools.clear();
+                for(auto &p : pools_)
+                    pools.push_back(p.get());
+            }
+            
+            for(token_pool *p : pools)
+            {
+                p->rearm();
+                if(p->depth() < p->low_water() || 0 == p->refills())
+                    p->refill(src, scratch);
+            }
+        }
+    }
+    
+    bool allow_kernel_;
+    delimiter_mode delim_;
+    size_t capacity_;
+    size_t low_water_;
+    size_t memory_ = 0; // of all pools, see find()
+    fnd::vector<std::unique_ptr<token_pool>> pools_;
+    std::mutex m_;
+    std::condition_variable cv_;
+    bool wanted_ = false;
+    bool stop_ = false;
+    std::thread thread_;
+};
+
+//------------------------------------------------------------------------------
+/** Answers the requests of --serve.
+ *
+ * A request is a line 'COUNT LENGTH [CONFIG]' asking for COUNT strings of
+ * LENGTH characters from the alphabet given by CONFIG, or the one given on
+ * the server's command line if CONFIG is omitted. The answer is a line
+ * 'OK SIZE' followed by SIZE bytes of strings, each one followed by the
+ * server's delimiter, or a line 'ERR MESSAGE'. Clients may send requests
+ * without waiting for the answers, which come in order. The request
+ * 'STATS' is answered with a line per token pool.
+ *
+ * The alphabets of the last max_profiles configs are kept, so repeated
+ * requests skip parsing and table building. With a token_pool_set, strings
+ * are taken from a pool of ready ones where possible.
+ */
+template <class Rnd>
+class token_service
+{
+public:
+    static constexpr size_t max_request_size = 4096;
+    static constexpr uint64_t max_response_size = 16 << 20;
+    static constexpr size_t max_profiles = 64;
+    
+    token_service(
+        Rnd &rnd,
+        const size_t block_size,
+        const fnd::vector<fnd::array<char32_t, 2>> &ranges,
+        const delimiter_mode delim,
+        const bool allow_kernel,
+        token_pool_set *pools = nullptr)
+    : src_(rnd, block_size), delim_(delim), allow_kernel_(allow_kernel),
+        pools_(pools)
+    {
+        if(!ranges.empty())
+        {
+            default_.ranges = ranges;
+            default_.profile.reset(new token_profile(ranges, allow_kernel));
+        }
+    }
+    
+    /** Appends the answer to the request @p line, without its line feed,
+     * to @p out.
+     */
+    void operator () (const fnd::const_cstring line, chunk_buffer &out)
+    {
+        ++requests_;
+        
+        if(line == "STATS")
+        {
+            payload_.wipe();
+            if(pools_)
+                pools_->stats(payload_);
+            answer(out);
+            return;
+        }
+        
+        const char *i = std::find(line.begin(), line.end(), ' ');
+        const fnd::const_cstring count_s{line.begin(), i};
+        const char *j = line.end() == i ?
+            i : std::find(i + 1, line.end(), ' ');
+        const fnd::const_cstring length_s{line.end() == i ? i : i + 1, j};
+        const fnd::const_cstring config{line.end() == j ? j : j + 1,
+            line.end()};
+        
+        fnd::optional<uint64_t> count = fmt::to_integer<uint64_t>(
+            count_s, 10, fnd::nothrow_tag());
+        fnd::optional<uint64_t> length = fmt::to_integer<uint64_t>(
+            length_s, 10, fnd::nothrow_tag());
+        if(!count.valid() || !length.valid())
+        {
+            fail(out, "Expected 'COUNT LENGTH [CONFIG]'.");
+            return;
+        }
+        
+        cached_profile *entry = find_profile(config, out);
+        if(!entry)
+            return;
+        token_profile &prof = *entry->profile;
+        
+        // The count is bounded on its own as well, empty tokens without a
+        // delimiter take no room but still a turn of the loop each.
+        const uint64_t delim_size = delimiter_mode::none == delim_ ? 0 : 1;
+        if(length.get() > max_response_size
+            || count.get() > max_response_size
+            || (0 != count.get() && (length.get() * prof.max_char_size()
+                    + delim_size) > max_response_size / count.get()))
+        {
+            fail(out, "Request too large.");
+            return;
+        }
+        
+        // UTF-8 output has no fixed size, so the answer is put together
+        // on the side.
+        payload_.wipe();
+        uint64_t k = 0;
+        if(pools_ && 0 != length.get())
+        {
+            token_pool *pool = pools_->find(
+                config, entry->ranges, size_t(length.get()));
+            if(pool)
+            {
+                k = pool->take(size_t(count.get()), payload_);
+                if(pool->wants_refill())
+                    pools_->wake();
+            }
+        }
+        for(; k < count.get(); ++k)
+        {
+            if(0 != length.get())
+                prof(size_t(length.get()), src_, payload_);
+            put_delimiter(delim_, payload_);
+        }
+        answer(out);
+        
+        tokens_ += count.get();
+    }
+    
+    inline uint64_t requests() const noexcept {
+        return requests_;
+    }
+    inline uint64_t tokens() const noexcept {
+        return tokens_;
+    }
+    inline const block_entropy<Rnd> &entropy() const noexcept {
+        return src_;
+    }
+    
+private:
+    struct cached_profile
+    {
+        fnd::string config;
+        fnd::vector<fnd::array<char32_t, 2>> ranges;
+        std::unique_ptr<token_profile> profile;
+    };
+    
+    cached_profile *find_profile(
+        const fnd::const_cstring config, chunk_buffer &out)
+    {
+        if(config.empty())
+        {
+            if(!default_.profile)
+            {
+                fail(out, "The server has no default alphabet.");
+                return nullptr;
+            }
+            return &default_;
+        }
+        
+        for(auto &c : cache_)
+            if(c.config.size() == config.size()
+                && 0 == std::memcmp(c.config.data(), config.data(),
+                    config.size()))
+                return &c;
+        
+        fnd::vector<fnd::array<char32_t, 2>> ranges;
+        errc err;
+        size_t pos;
+        fnd::tie(err, pos) = parse_config(config, ranges);
+        if(errc::success != err)
+        {
+            fail(out, fnd::system::error_code(err).message());
+            return nullptr;
+        }
+        if(ranges.empty())
+        {
+            fail(out, "Empty config.");
+            return nullptr;
+        }
+        // Clients with '--unique-chars' send deduplicated configs.
+        normalize_ranges(ranges, false);
+        
+        if(max_profiles == cache_.size())
+            cache_.erase(cache_.begin());
+        cache_.emplace_back();
+        cache_.back().config.assign(config.begin(), config.end());
+        cache_.back().profile.reset(
+            new token_profile(ranges, allow_kernel_));
+        cache_.back().ranges = fnd::move(ranges);
+        return &cache_.back();
+    }
+    
+    /** Moves the payload to @p out behind an 'OK' line.
+     */
+    void answer(chunk_buffer &out)
+    {
+        char head[32];
+        const int n = std::snprintf(head, sizeof(head), "OK %llu\n",
+            static_cast<unsigned long long>(payload_.size()));
+        std::memcpy(out.reserve(size_t(n)), head, size_t(n));
+        out.commit(size_t(n));
+        std::memcpy(out.reserve(payload_.size()), payload_.data(),
+            payload_.size());
+        out.commit(payload_.size());
+        payload_.wipe();
+    }
+    
+    static void fail(chunk_buffer &out, const fnd::const_cstring msg)
+    {
+        const fnd::const_cstring err = "ERR ";
+        char *p = out.reserve(err.size() + msg.size() + 1);
+        std::memcpy(p, err.data(), err.size());
+        std::memcpy(p + err.size(), msg.data(), msg.size());
+        p[err.size() + msg.size()] = '\n';
+        out.commit(err.size() + msg.size() + 1);
+    }
+    
+    block_entropy<Rnd> src_;
+    delimiter_mode delim_;
+    bool allow_kernel_;
+    token_pool_set *pools_;
+    cached_profile default_;
+    fnd::vector<cached_profile> cache_;
+    chunk_buffer payload_;
+    uint64_t requests_ = 0;
+    uint64_t tokens_ = 0;
+};
+
+//------------------------------------------------------------------------------
+/** Binds a listening UNIX socket to @p path, which only the owner may
+ * connect to. A socket file left behind by a dead server is replaced.
+ * @return The file descriptor or -1 after logging the error.
+ */
+inline int listen_unix(const char *path)
+{
+    struct sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(std::strlen(path) >= sizeof(addr.sun_path))
+    {
+        gl->error("Socket path '", path, "' is too long.");
+        return -1;
+    }
+    std::strcpy(addr.sun_path, path);
+    
+    struct stat st;
+    if(0 == ::lstat(path, &st) && S_ISSOCK(st.st_mode))
+    {
+        const int probe = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if(probe >= 0)
+        {
+            if(0 != ::connect(probe, reinterpret_cast<sockaddr *>(&addr),
+                    sizeof(addr))
+                && ECONNREFUSED == errno)
+            {
+                gl->debug("Removing stale socket '", path, "'.");
+                ::unlink(path);
+            }
+            ::close(probe);
+        }
+    }
+    
+    const int fd = ::socket(AF_UNIX,
+        SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd < 0)
+    {
+        gl->error("Unable to create socket: ", std::strerror(errno));
+        return -1;
+    }
+    
+    const mode_t old_mask = ::umask(0177);
+    const int r = ::bind(fd, reinterpret_cast<sockaddr *>(&addr),
+        sizeof(addr));
+    ::umask(old_mask);
+    if(0 != r || 0 != ::listen(fd, SOMAXCONN))
+    {
+        gl->error("Unable to listen on '", path, "': ", std::strerror(errno));
+        ::close(fd);
+        return -1;
+    }
+    
+    return fd;
+}
+//------------------------------------------------------------------------------
+/** @return A socket connected to @p path or -1 after logging the error.
+ */
+inline int connect_unix(const char *path)
+{
+    struct sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(std::strlen(path) >= sizeof(addr.sun_path))
+    {
+        gl->error("Socket path '", path, "' is too long.");
+        return -1;
+    }
+    std::strcpy(addr.sun_path, path);
+    
+    const int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd < 0)
+    {
+        gl->error("Unable to create socket: ", std::strerror(errno));
+        return -1;
+    }
+    if(0 != ::connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)))
+    {
+        gl->error("Unable to connect to '", path, "': ",
+            std::strerror(errno));
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+//------------------------------------------------------------------------------
+/** Serves requests on the UNIX socket @p path until SIGINT or SIGTERM.
+ *
+ * All connections are handled by one epoll loop. Every complete request
+ * line is passed to @p handle together with the connection's output buffer
+ * to append the answer to. A connection isn't read from while more than
+ * high_water bytes of answers are waiting to be sent, which pushes back on
+ * clients that don't read.
+ *
+ * @return The exit status.
+ */
+template <class Handler>
+inline int serve(const char *path, const size_t max_request_size,
+    Handler &&handle)
+{
+#ifdef __linux__
+    constexpr size_t high_water = 1 << 20;
+    
+    struct connection
+    {
+        explicit connection(const int fd_) : fd(fd_) {}
+        ~connection() {
+            ::close(fd);
+        }
+        
+        int fd;
+        fnd::vector<char> in;
+        chunk_buffer out;
+        size_t sent = 0;
+        uint32_t events = EPOLLIN;
+        bool eof = false;
+    };
+    
+    sigset_t sigs;
+    ::sigemptyset(&sigs);
+    ::sigaddset(&sigs, SIGINT);
+    ::sigaddset(&sigs, SIGTERM);
+    sigset_t old_sigs;
+    ::pthread_sigmask(SIG_BLOCK, &sigs, &old_sigs);
+    
+    const int lfd = listen_unix(path);
+    const int sfd = ::signalfd(-1, &sigs, SFD_NONBLOCK | SFD_CLOEXEC);
+    const int ep = ::epoll_create1(EPOLL_CLOEXEC);
+    fnd::vector<std::unique_ptr<connection>> conns;
+    n_scope_exit() {
+        conns.clear();
+        if(ep >= 0)
+            ::close(ep);
+        if(sfd >= 0)
+            ::close(sfd);
+        if(lfd >= 0)
+        {
+            ::close(lfd);
+            ::unlink(path);
+        }
+        ::pthread_sigmask(SIG_SETMASK, &old_sigs, nullptr);
+    };
+    if(lfd < 0)
+        return EXIT_FAILURE;
+    if(sfd < 0 || ep < 0)
+        n_throw(runtime_error);
+    
+    // The listening socket and the signalfd are told apart by address.
+    char listen_tag = 0, signal_tag = 0;
+    {
+        struct epoll_event ev;
+        std::memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = &listen_tag;
+        if(0 != ::epoll_ctl(ep, EPOLL_CTL_ADD, lfd, &ev))
+            n_throw(runtime_error);
+        ev.data.ptr = &signal_tag;
+        if(0 != ::epoll_ctl(ep, EPOLL_CTL_ADD, sfd, &ev))
+            n_throw(runtime_error);
+    }
+    
+    gl->info("Listening on '", path, "'.");
+    
+    // Answers complete requests until the output backs up.
+    auto process = [&] (connection &c) {
+        size_t pos = 0;
+        while(c.out.size() - c.sent < high_water)
+        {
+            const char *beg = c.in.data() + pos;
+            const char *end = c.in.data() + c.in.size();
+            const char *nl = std::find(beg, end, '\n');
+            if(end == nl)
+            {
+                if(size_t(end - beg) > max_request_size)
+                {
+                    const fnd::const_cstring msg = "ERR Request too long.\n";
+                    std::memcpy(c.out.reserve(msg.size()), msg.data(),
+                        msg.size());
+                    c.out.commit(msg.size());
+                    c.eof = true;
+                    pos = c.in.size();
+                }
+                break;
+            }
+            const char *last = nl;
+            if(last != beg && '\r' == last[-1])
+                --last;
+            handle(fnd::const_cstring{beg, last}, c.out);
+            pos = size_t(nl - c.in.data()) + 1;
+        }
+        c.in.erase(c.in.begin(), c.in.begin() + pos);
+    };
+    // @return False if the connection is broken.
+    auto send = [&] (connection &c) {
+        while(c.sent < c.out.size())
+        {
+            const ssize_t r = ::send(c.fd, c.out.data() + c.sent,
+                c.out.size() - c.sent, MSG_NOSIGNAL);
+            if(r < 0)
+            {
+                if(EINTR == errno)
+                    continue;
+                if(EAGAIN == errno || EWOULDBLOCK == errno)
+                    break;
+                return false;
+            }
+            c.sent += size_t(r);
+        }
+        if(c.sent == c.out.size())
+        {
+            c.out.clear();
+            c.sent = 0;
+        }
+        return true;
+    };
+    // @return False if the connection is done.
+    auto service = [&] (connection &c, const uint32_t revents) {
+        if(revents & EPOLLERR)
+            return false;
+        if(revents & EPOLLIN)
+        {
+            char buf[1 << 16];
+            const ssize_t r = ::read(c.fd, buf, sizeof(buf));
+            if(r > 0)
+                c.in.insert(c.in.end(), buf, buf + r);
+            else if(0 == r)
+                c.eof = true;
+            else if(EINTR != errno && EAGAIN != errno
+                && EWOULDBLOCK != errno)
+                return false;
+        }
+        else if(revents & EPOLLHUP)
+            c.eof = true;
+        
+        // Keep going as long as the answers leave at once.
+        size_t left;
+        do
+        {
+            process(c);
+            if(!send(c))
+                return false;
+            left = c.in.size();
+        } while(0 == c.out.size() && 0 != left
+            && c.in.end() != std::find(c.in.begin(), c.in.end(), '\n'));
+        
+        const size_t pending = c.out.size() - c.sent;
+        if(c.eof && 0 == pending)
+            return false;
+        
+        uint32_t events = 0;
+        if(!c.eof && pending < high_water)
+            events |= EPOLLIN;
+        if(0 != pending)
+            events |= EPOLLOUT;
+        if(events != c.events)
+        {
+            struct epoll_event ev;
+            std::memset(&ev, 0, sizeof(ev));
+            ev.events = events;
+            ev.data.ptr = &c;
+            if(0 != ::epoll_ctl(ep, EPOLL_CTL_MOD, c.fd, &ev))
+                n_throw(runtime_error);
+            c.events = events;
+        }
+        return true;
+    };
+    
+    struct epoll_event events[64];
+    bool quit = false;
+    while(!quit)
+    {
+        const int n = ::epoll_wait(ep, events, 64, -1);
+        if(n < 0)
+        {
+            if(EINTR == errno)
+                continue;
+            n_throw(runtime_error);
+        }
+        
+        for(int k = 0; k < n; ++k)
+        {
+            void *const tag = events[k].data.ptr;
+            if(&signal_tag == tag)
+            {
+                struct signalfd_siginfo si;
+                while(::read(sfd, &si, sizeof(si)) == sizeof(si))
+                    quit = true;
+            }
+            else if(&listen_tag == tag)
+            {
+                while(true)
+                {
+                    const int cfd = ::accept4(lfd, nullptr, nullptr,
+                        SOCK_NONBLOCK | SOCK_CLOEXEC);
+                    if(cfd < 0)
+                    {
+                        if(EINTR == errno || ECONNABORTED == errno)
+                            continue;
+                        if(EAGAIN != errno && EWOULDBLOCK != errno)
+                            gl->warning("accept() failed: ",
+                                std::strerror(errno));
+                        break;
+                    }
+                    conns.emplace_back(new connection(cfd));
+                    
+                    struct epoll_event ev;
+                    std::memset(&ev, 0, sizeof(ev));
+                    ev.events = EPOLLIN;
+                    ev.data.ptr = conns.back().get();
+                    if(0 != ::epoll_ctl(ep, EPOLL_CTL_ADD, cfd, &ev))
+                        n_throw(runtime_error);
+                    gl->debug("Connection ", cfd, " opened.");
+                }
+            }
+            else
+            {
+                connection &c = *static_cast<connection *>(tag);
+                if(!service(c, events[k].events))
+                {
+                    gl->debug("Connection ", c.fd, " closed.");
+                    auto it = std::find_if(conns.begin(), conns.end(),
+                        [&] (const std::unique_ptr<connection> &x) {
+                            return x.get() == &c;
+                        });
+                    conns.erase(it);
+                }
+            }
+        }
+    }
+    
+    gl->info("Shutting down.");
+    return EXIT_SUCCESS;
+#else
+    gl->error("'--serve' is only supported on Linux.");
+    return EXIT_FAILURE;
+#endif
+}
+
+//------------------------------------------------------------------------------
+/** Talks to a --serve server, see token_service for the protocol.
+ */
+class token_client
+{
+public:
+    explicit token_client(const int fd)
+    : fd_(fd)
+    {
+        in_.resize(1 << 16);
+    }
+    token_client(const token_client &) = delete;
+    token_client &operator=(const token_client &) = delete;
+    
+    ~token_client()
+    {
+        secure_zero(in_.data(), in_.size());
+    }
+    
+    /** Queues a request for @p count strings of @p length characters, which
+     * is sent by the next call to send().
+     */
+    void request(
+        const uint64_t count,
+        const uint64_t length,
+        const fnd::const_cstring config)
+    {
+        char head[48];
+        const int n = std::snprintf(head, sizeof(head), "%llu %llu",
+            static_cast<unsigned long long>(count),
+            static_cast<unsigned long long>(length));
+        pending_.insert(pending_.end(), head, head + n);
+        if(!config.empty())
+        {
+            pending_.push_back(' ');
+            pending_.insert(pending_.end(), config.begin(), config.end());
+        }
+        pending_.push_back('\n');
+    }
+    
+    /** Queues a 'STATS' request.
+     */
+    void request_stats()
+    {
+        const fnd::const_cstring line = "STATS\n";
+        pending_.insert(pending_.end(), line.begin(), line.end());
+    }
+    
+    void send()
+    {
+        size_t pos = 0;
+        while(pos < pending_.size())
+        {
+            const ssize_t r = ::send(fd_, pending_.data() + pos,
+                pending_.size() - pos, MSG_NOSIGNAL);
+            if(r < 0)
+            {
+                if(EINTR == errno)
+                    continue;
+                n_throw(runtime_error);
+            }
+            pos += size_t(r);
+        }
+        pending_.clear();
+    }
+    
+    /** Reads the next answer and passes its strings to @p out.write().
+     * @return False after logging the error if the server refused the
+     *  request or went away.
+     */
+    template <class Out>
+    bool receive(Out &out)
+    {
+        const char *nl;
+        while(true)
+        {
+            nl = std::find(in_.data() + pos_, in_.data() + end_, '\n');
+            if(in_.data() + end_ != nl)
+                break;
+            if(end_ - pos_ > max_header_size)
+            {
+                gl->error("Invalid answer from the server.");
+                return false;
+            }
+            if(!fill())
+                return false;
+        }
+        
+        const fnd::const_cstring head{in_.data() + pos_, nl};
+        pos_ = size_t(nl - in_.data()) + 1;
+        
+        const fnd::const_cstring ok = "OK ", err = "ERR ";
+        if(head.size() > err.size()
+            && 0 == std::memcmp(head.data(), err.data(), err.size()))
+        {
+            gl->error("The server says: ",
+                fnd::const_cstring{head.begin() + err.size(), head.end()});
+            return false;
+        }
+        fnd::optional<uint64_t> size;
+        if(head.size() > ok.size()
+            && 0 == std::memcmp(head.data(), ok.data(), ok.size()))
+        {
+            size = fmt::to_integer<uint64_t>(
+                {head.begin() + ok.size(), head.end()},
+                10, fnd::nothrow_tag());
+        }
+        if(!size.valid())
+        {
+            gl->error("Invalid answer from the server.");
+            return false;
+        }
+        
+        uint64_t left = size.get();
+        while(0 != left)
+        {
+            if(pos_ == end_ && !fill())
+                return false;
+            const size_t n = uint64_t(end_ - pos_) < left ?
+                end_ - pos_ : size_t(left);
+            out.write(in_.data() + pos_, n);
+            pos_ += n;
+            left -= n;
+        }
+        return true;
+    }
+    
+private:
+    static constexpr size_t max_header_size = 64;
+    
+    bool fill()
+    {
+        if(pos_ == end_)
+            pos_ = end_ = 0;
+        else if(end_ == in_.size())
+        {
+            std::memmove(in_.data(), in_.data() + pos_, end_ - pos_);
+            end_ -= pos_;
+            pos_ = 0;
+        }
+        
+        while(true)
+        {
+            const ssize_t r = ::read(fd_, in_.data() + end_,
+                in_.size() - end_);
+            if(r < 0)
+            {
+                if(EINTR == errno)
+                    continue;
+                n_throw(runtime_error);
+            }
+            if(0 == r)
+            {
+                gl->error("Connection closed by the server.");
+                return false;
+            }
+            end_ += size_t(r);
+            return true;
+        }
+    }
+    
+    int fd_;
+    fnd::vector<char> pending_;
+    fnd::vector<char> in_;
+    size_t pos_ = 0;
+    size_t end_ = 0;
+};
+
+} // anonymous
+
+//------------------------------------------------------------------------------
+fnd::string to_config(
+    const fnd::vector<fnd::array<char32_t, 2>> &ranges)
+{
+    io::msink<fnd::string> ss;
+    for(const auto &r : ranges)
+        fmt::fwrite(ss, "(U+", fmt::hex(uint32_t(r[0])),
+            " U+", fmt::hex(uint32_t(r[1] - 1)), ')');
+    return fnd::move(ss.container());
+}
+//------------------------------------------------------------------------------
+int run_serve(
+    const char *path,
+    const random_mode rndmode,
+    const size_t block_size,
+    const fnd::vector<fnd::array<char32_t, 2>> &ranges,
+    const delimiter_mode delim,
+    const size_t pool_size,
+    const size_t pool_low)
+{
+    int status = EXIT_FAILURE;
+    with_random_device(rndmode, [&] (auto &rnd) {
+        using rnd_type = std::decay_t<decltype(rnd)>;
+        std::unique_ptr<token_pool_set> pools;
+        if(0 != pool_size)
+        {
+            pools.reset(new token_pool_set(rndmode, block_size,
+                !drains_entropy(rndmode), delim, pool_size, pool_low));
+        }
+        token_service<rnd_type> svc(rnd, block_size, ranges, delim,
+            !drains_entropy(rndmode), pools.get());
+        status = serve(path,
+            token_service<rnd_type>::max_request_size, svc);
+        gl->info("Served ", svc.requests(), " requests, ",
+            svc.tokens(), " strings, read ",
+            svc.entropy().bytes_read(), " bytes from the RNG.");
+        if(pools)
+        {
+            chunk_buffer stats;
+            pools->stats(stats);
+            if(0 != stats.size())
+                gl->info("Token pools:", fmt::endl, fnd::const_cstring{
+                    stats.data(), stats.data() + stats.size() - 1});
+        }
+    });
+    return status;
+}
+//------------------------------------------------------------------------------
+bool fetch_tokens(
+    const char *path,
+    const uint64_t count,
+    const size_t length,
+    const fnd::const_cstring config,
+    const unsigned pipeline,
+    output_buffer &out)
+{
+    const int fd = connect_unix(path);
+    if(fd < 0)
+        return false;
+    n_scope_exit() {
+        ::close(fd);
+    };
+    token_client client(fd);
+    
+    // Ask for about 64k characters at once.
+    const uint64_t per_request = length < (1 << 16) ?
+        (uint64_t(1) << 16) / (length + 1) : 1;
+    const uint64_t nrequests = (count + per_request - 1) / per_request;
+    
+    uint64_t sent = 0;
+    for(uint64_t done = 0; done < nrequests; ++done)
+    {
+        for(; sent < nrequests && sent - done < pipeline; ++sent)
+        {
+            const uint64_t first = sent * per_request;
+            client.request(count - first < per_request ?
+                count - first : per_request, length, config);
+        }
+        client.send();
+        if(!client.receive(out))
+            return false;
+    }
+    return true;
+}
+//------------------------------------------------------------------------------
+bool fetch_pool_stats(const char *path, output_buffer &out)
+{
+    const int fd = connect_unix(path);
+    if(fd < 0)
+        return false;
+    n_scope_exit() {
+        ::close(fd);
+    };
+    token_client client(fd);
+    client.request_stats();
+    client.send();
+    return client.receive(out);
+}
+//------------------------------------------------------------------------------
+bool run_load(
+    const char *path,
+    const unsigned nconns,
+    const uint64_t nrequests,
+    const unsigned pipeline,
+    const uint64_t count,
+    const size_t length,
+    const fnd::const_cstring config)
+{
+    using clock = chrono::steady_clock;
+    
+    struct byte_counter
+    {
+        inline void write(const char *, const size_t n) noexcept {
+            bytes += n;
+        }
+        uint64_t bytes = 0;
+    };
+    struct conn_result
+    {
+        fnd::vector<uint64_t> latencies; // nanoseconds
+        uint64_t bytes = 0;
+        bool ok = true;
+        fnd::exception_ptr error;
+    };
+    
+    if(0 == nconns || 0 == pipeline)
+        n_throw(logic_error);
+    
+    fnd::vector<int> fds;
+    n_scope_exit() {
+        for(const int fd : fds)
+            ::close(fd);
+    };
+    for(unsigned w = 0; w < nconns; ++w)
+    {
+        const int fd = connect_unix(path);
+        if(fd < 0)
+            return false;
+        fds.push_back(fd);
+    }
+    
+    fnd::vector<conn_result> results(nconns);
+    auto run = [&] (const unsigned w) {
+        conn_result &res = results[w];
+        try {
+            token_client client(fds[w]);
+            byte_counter sink;
+            const uint64_t n = nrequests / nconns
+                + (w < nrequests % nconns ? 1 : 0);
+            res.latencies.reserve(size_t(n));
+            fnd::vector<clock::time_point> started(pipeline);
+            
+            uint64_t sent = 0;
+            for(uint64_t done = 0; done < n; ++done)
+            {
+                for(; sent < n && sent - done < pipeline; ++sent)
+                {
+                    client.request(count, length, config);
+                    started[sent % pipeline] = clock::now();
+                }
+                client.send();
+                if(!client.receive(sink))
+                {
+                    res.ok = false;
+                    return;
+                }
+                res.latencies.push_back(uint64_t(
+                    chrono::duration_cast<chrono::nanoseconds>(
+                        clock::now() - started[done % pipeline]).count()));
+            }
+            res.bytes = sink.bytes;
+        }
+        catch(...) {
+            res.error = fnd::current_exception();
+        }
+    };
+    
+    const clock::time_point start = clock::now();
+    {
+        fnd::vector<std::thread> threads;
+        for(unsigned w = 0; w < nconns; ++w)
+            threads.emplace_back(run, w);
+        for(auto &t : threads)
+            t.join();
+    }
+    const double seconds = chrono::duration_cast<chrono::duration<double>>(
+        clock::now() - start).count();
+    
+    fnd::vector<uint64_t> lat;
+    uint64_t bytes = 0;
+    for(auto &res : results)
+    {
+        if(res.error)
+            std::rethrow_exception(res.error);
+        if(!res.ok)
+            return false;
+        lat.insert(lat.end(), res.latencies.begin(), res.latencies.end());
+        bytes += res.bytes;
+    }
+    std::sort(lat.begin(), lat.end());
+    
+    auto percentile = [&] (const double q) {
+        return percentile_us(lat, q);
+    };
+    
+    fmt::fwrite(io::cout,
+        "connections: ", nconns, fmt::endl,
+        "pipeline: ", pipeline, fmt::endl,
+        "requests: ", nrequests, fmt::endl,
+        "tokens: ", nrequests * count, fmt::endl,
+        "bytes: ", bytes, fmt::endl,
+        "seconds: ", seconds, fmt::endl,
+        "requests/s: ", double(nrequests) / seconds, fmt::endl,
+        "tokens/s: ", double(nrequests * count) / seconds, fmt::endl,
+        "MiB/s: ", double(bytes) / seconds / double(1 << 20), fmt::endl,
+        "latency p50 (us): ", percentile(0.5), fmt::endl,
+        "latency p99 (us): ", percentile(0.99), fmt::endl,
+        "latency p99.9 (us): ", percentile(0.999), fmt::endl,
+        "latency max (us): ", percentile(1.0), fmt::endl);
+    return true;
+}
@@ -0,0 +1,78 @@
+/*--!>
+This file is part of 'rstr', a simple random string generator written in C++.
+
+Copyright 2016 outshined (outshined@riseup.net)
+    (PGP: 0x8A80C12396A4836F82A93FA79CA3D0F7E8FBCED6)
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, either version 3 of the
+License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+--------------------------------------------------------------------------<!--*/
+#ifndef RSTR_SERVE_H
+#define RSTR_SERVE_H
+
+#include "worker.h"
+
+//------------------------------------------------------------------------------
+/** Formats @p ranges as a config, which parse_config() turns back into the
+ * same ranges.
+ */
+fnd::string to_config(
+    const fnd::vector<fnd::array<char32_t, 2>> &ranges);
+//------------------------------------------------------------------------------
+/** Answers the requests of clients on the UNIX socket @p path until SIGINT
+ * or SIGTERM, see token_service. Requests without a config get strings of
+ * @p ranges. With a @p pool_size, token pools of that many strings are
+ * kept, refilled once they drop below @p pool_low.
+ * @return The exit status.
+ */
+int run_serve(
+    const char *path,
+    const random_mode rndmode,
+    const size_t block_size,
+    const fnd::vector<fnd::array<char32_t, 2>> &ranges,
+    const delimiter_mode delim,
+    const size_t pool_size,
+    const size_t pool_low);
+//------------------------------------------------------------------------------
+/** Fetches @p count strings from the server at @p path and writes them to
+ * @p out, keeping up to @p pipeline requests in flight.
+ * @return False after logging the error.
+ */
+bool fetch_tokens(
+    const char *path,
+    const uint64_t count,
+    const size_t length,
+    const fnd::const_cstring config,
+    const unsigned pipeline,
+    output_buffer &out);
+//------------------------------------------------------------------------------
+/** Writes the pool stats of the server at @p path to @p out.
+ * @return False after logging the error.
+ */
+bool fetch_pool_stats(const char *path, output_buffer &out);
+//------------------------------------------------------------------------------
+/** Sends @p nrequests requests for @p count strings of @p length characters
+ * to the server at @p path over @p nconns connections, each keeping up to
+ * @p pipeline requests in flight, and prints the throughput and latency.
+ * @return False after logging the error.
+ */
+bool run_load(
+    const char *path,
+    const unsigned nconns,
+    const uint64_t nrequests,
+    const unsigned pipeline,
+    const uint64_t count,
+    const size_t length,
+    const fnd::const_cstring config);
+
+#endif // RSTR_SERVE_H
@@ -0,0 +1,144 @@
+/*--!>
+This file is part of 'rstr', a simple random string generator written in C++.
+
+Copyright 2016 outshined (outshined@riseup.net)
+    (PGP: 0x8A80C12396A4836F82A93FA79CA3D0F7E8FBCED6)
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, either version 3 of the
+License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+--------------------------------------------------------------------------<!--*/
+#include "../rstr/core.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+namespace {
+
+//------------------------------------------------------------------------------
+struct alphabet
+{
+    const char *name;
+    fnd::vector<fnd::array<char32_t, 2>> ranges;
+};
+//------------------------------------------------------------------------------
+/** Draws @p draws characters of @p a through index_sampler and symbol_table
+ * and counts each by where it lies in the ranges, so the table's mapping is
+ * tested along with the sampler.
+ * @return The chi-square statistic, or a negative value if a character isn't
+ *  part of the alphabet.
+ */
+template <class Entropy>
+double chi_square(const alphabet &a, const uint64_t draws, Entropy &src)
+{
+    fnd::vector<char32_t> first;
+    fnd::vector<uint64_t> offsets(1, 0);
+    for(const auto &r : a.ranges)
+    {
+        first.push_back(r[0]);
+        offsets.push_back(offsets.back() + (r[1] - r[0]));
+    }
+    
+    const symbol_table tab(a.ranges);
+    index_sampler sampler(tab.size());
+    fnd::vector<uint64_t> counts(size_t(tab.size()), 0);
+    
+    for(uint64_t i = 0; i < draws; ++i)
+    {
+        const char32_t c = tab[sampler(src)];
+        const size_t k = size_t(
+            std::upper_bound(first.begin(), first.end(), c) - first.begin());
+        if(0 == k || c >= a.ranges[k-1][1])
+            return -1;
+        ++counts[size_t(offsets[k-1] + (c - first[k-1]))];
+    }
+    
+    const double expected = double(draws) / double(tab.size());
+    double x = 0;
+    for(const uint64_t n : counts)
+        x += (double(n) - expected) * (double(n) - expected) / expected;
+    return x;
+}
+//------------------------------------------------------------------------------
+/** The Wilson-Hilferty approximation of the chi-square distribution with
+ * @p df degrees of freedom, as a standard normal variable.
+ */
+inline double z_score(const double x, const double df)
+{
+    const double v = 2 / (9 * df);
+    return (std::cbrt(x / df) - (1 - v)) / std::sqrt(v);
+}
+
+} // anonymous
+
+//------------------------------------------------------------------------------
+/** Tests that every character of a few alphabets is equally likely.
+ *
+ * Usage: chi_square [DRAWS]
+ *
+ * Alphabets whose sizes are no powers of two exercise the rejection in
+ * index_sampler, the multi-range ones the flat UTF-8 and the guide tables of
+ * symbol_table. A result more than 5 standard deviations off fails, which a
+ * sound sampler does about once in 1.7 million runs.
+ */
+int main(int argc, char **argv)
+{
+    uint64_t draws = 100000000;
+    if(argc > 1)
+        draws = std::strtoull(argv[1], nullptr, 10);
+    if(0 == draws)
+        return EXIT_FAILURE;
+    
+    fnd::vector<alphabet> alphabets;
+    alphabets.push_back({"binary", {{U'0', U'2'}}});
+    alphabets.push_back({"three", {{U'a', U'd'}}});
+    alphabets.push_back({"digits", {{U'0', U':'}}});
+    alphabets.push_back({"alnum", {{U'0', U':'}, {U'A', U'['}, {U'a', U'{'}}});
+    alphabets.push_back({"graph", {{U'!', U'\x7f'}}});
+    alphabets.push_back({"cjk-1000", {{0x4E00, 0x4E00 + 1000}}});
+    alphabets.push_back({"mixed-utf8",
+        {{U'0', U':'}, {U'a', U'{'}, {0x3041, 0x3097}}});
+    {
+        // Above symbol_table::max_flat_size, so looked up by the guide.
+        alphabet a{"scattered", {}};
+        for(char32_t k = 0; k < 250; ++k)
+            a.ranges.push_back({0x10000 + k * 400, 0x10000 + k * 400 + 301});
+        alphabets.push_back(fnd::move(a));
+    }
+    
+    fnd::random::pseudo_random_device rnd;
+    block_entropy<fnd::random::pseudo_random_device> src(rnd);
+    
+    int status = EXIT_SUCCESS;
+    for(const alphabet &a : alphabets)
+    {
+        uint64_t size = 0;
+        for(const auto &r : a.ranges)
+            size += r[1] - r[0];
+        
+        const double x = chi_square(a, draws, src);
+        const double z = x < 0 ? 0 : z_score(x, double(size - 1));
+        const bool ok = x >= 0 && std::fabs(z) <= 5;
+        if(!ok)
+            status = EXIT_FAILURE;
+        
+        if(x < 0)
+            fmt::fwrite(io::cout, a.name, ": a character outside of the "
+                "alphabet. FAILED", fmt::endl);
+        else
+            fmt::fwrite(io::cout, a.name, ": ", size, " characters, ",
+                draws, " draws, chi-square ", x, ", z ", z,
+                ok ? ". ok" : ". FAILED", fmt::endl);
+    }
+    return status;
+}
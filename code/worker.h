@@ -0,0 +1,345 @@
+/*--!>
+This file is part of 'rstr', a simple random string generator written in C++.
+
+Copyright 2016 outshined (outshined@riseup.net)
+    (PGP: 0x8A80C12396A4836F82A93FA79CA3D0F7E8FBCED6)
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, either version 3 of the
+License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+--------------------------------------------------------------------------<!--*/
+#ifndef RSTR_WORKER_H
+#define RSTR_WORKER_H
+
+#include "log.h"
+#include "output.h"
+
+#include <nebula/foundation/scope_exit.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+//------------------------------------------------------------------------------
+enum class delimiter_mode
+{
+    newline,
+    nul,
+    none
+};
+
+//------------------------------------------------------------------------------
+/** Sets up whatever the devices of @p rndmode depend on for the duration of
+ * the call to @p f.
+ */
+template <class F>
+inline void with_random_mode(const random_mode rndmode, F &&f)
+{
+    gl->info("Using '", to_cstr(rndmode), "' RNG.");
+    
+    switch(rndmode)
+    {
+    case random_mode::strong:
+    case random_mode::very_strong:
+        f();
+        break;
+    case random_mode::crypt_strong:
+    case random_mode::crypt_very_strong:
+    case random_mode::fast_crypt:
+        {
+            acquire_crypt();
+            n_scope_exit() {
+                release_crypt();
+            };
+            
+            f();
+        }
+        break;
+    default:
+        n_throw(logic_error);
+    }
+}
+//------------------------------------------------------------------------------
+/** Constructs the random device selected by @p rndmode and passes it to @p f.
+ */
+template <class F>
+inline void with_random_device(const random_mode rndmode, F &&f)
+{
+    with_random_mode(rndmode, [&] {
+        with_device(rndmode, f);
+    });
+}
+
+//------------------------------------------------------------------------------
+template <class Out>
+inline void put_delimiter(const delimiter_mode delim, Out &out)
+{
+    switch(delim)
+    {
+    case delimiter_mode::newline:
+        out.put('\n');
+        break;
+    case delimiter_mode::nul:
+        out.put('\0');
+        break;
+    case delimiter_mode::none:
+        break;
+    }
+}
+//------------------------------------------------------------------------------
+/** Generates the characters [first, last) of an output made of records of
+ * @p length characters, each followed by a delimiter.
+ */
+template <class Rnd>
+class record_worker
+{
+public:
+    /** @param kernel Used instead of @p tab if not null.
+     */
+    record_worker(
+        const symbol_table &tab,
+        const ascii_kernel *kernel,
+        const size_t length,
+        const delimiter_mode delim,
+        Rnd &rnd,
+        const size_t block_size)
+    : tab_(tab), kernel_(kernel), length_(length), delim_(delim),
+        sampler_(tab.size()), src_(rnd, block_size)
+    {
+        if(0 == length)
+            n_throw(logic_error);
+    }
+    record_worker(record_worker &&) = default;
+    
+    template <class Out>
+    void operator () (uint64_t first, const uint64_t last, Out &out)
+    {
+        while(first < last)
+        {
+            const uint64_t left = length_ - first % length_;
+            const size_t n = size_t(last - first < left ? last - first : left);
+            
+            if(kernel_)
+                gen_ascii(*kernel_, n, src_, out);
+            else
+                gen_from_ranges(tab_, sampler_, n, src_, out);
+            
+            first += n;
+            if(0 == first % length_)
+                put_delimiter(delim_, out);
+        }
+    }
+    
+    inline const index_sampler &sampler() const noexcept {
+        return sampler_;
+    }
+    inline const block_entropy<Rnd> &entropy() const noexcept {
+        return src_;
+    }
+    
+private:
+    const symbol_table &tab_;
+    const ascii_kernel *kernel_;
+    size_t length_;
+    delimiter_mode delim_;
+    index_sampler sampler_;
+    block_entropy<Rnd> src_;
+};
+//------------------------------------------------------------------------------
+/** Generates the tokens [first, last) of a template, each followed by a
+ * delimiter.
+ */
+template <class Rnd>
+class template_worker
+{
+public:
+    template_worker(
+        const token_template &tpl,
+        const delimiter_mode delim,
+        Rnd &rnd,
+        const size_t block_size)
+    : tpl_(tpl), delim_(delim), state_(tpl), src_(rnd, block_size)
+    {}
+    template_worker(template_worker &&) = default;
+    
+    template <class Out>
+    void operator () (uint64_t first, const uint64_t last, Out &out)
+    {
+        for(; first < last; ++first)
+        {
+            gen_template(tpl_, state_, src_, out);
+            put_delimiter(delim_, out);
+        }
+    }
+    
+private:
+    const token_template &tpl_;
+    delimiter_mode delim_;
+    template_state state_;
+    block_entropy<Rnd> src_;
+};
+//------------------------------------------------------------------------------
+/** Reads the bytes [first, last) of a raw output.
+ */
+template <class Rnd>
+class raw_worker
+{
+public:
+    explicit raw_worker(Rnd &rnd)
+    : rnd_(rnd)
+    {}
+    
+    template <class Out>
+    void operator () (const uint64_t first, const uint64_t last, Out &out)
+    {
+        const size_t n = size_t(last - first);
+        read_random(rnd_, out.reserve(n), n);
+        out.commit(n);
+    }
+    
+private:
+    Rnd &rnd_;
+};
+
+//------------------------------------------------------------------------------
+/** Splits an output of @p total units into chunks of @p chunk units,
+ * generates them on @p nthreads threads and writes them to @p out in order.
+ *
+ * Every thread constructs its own random device, so that no state is shared
+ * and each device gets seeded on its own, and passes it to @p make_work,
+ * which has to return a worker like record_worker or raw_worker. Each
+ * thread takes every nthreads-th chunk and owns two buffers, so it can
+ * fill one while the other one is waiting to be written.
+ *
+ * Must be called within with_random_mode().
+ */
+template <class MakeWork>
+inline void run_parallel(
+    const random_mode rndmode,
+    const unsigned nthreads,
+    const uint64_t total,
+    const uint64_t chunk,
+    output_buffer &out,
+    MakeWork &&make_work)
+{
+    struct slot
+    {
+        chunk_buffer buf;
+        bool full = false;
+    };
+    struct worker_state
+    {
+        std::mutex m;
+        std::condition_variable cv;
+        slot slots[2];
+    };
+    
+    if(0 == nthreads || 0 == chunk)
+        n_throw(logic_error);
+    
+    const uint64_t nchunks = (total + chunk - 1) / chunk;
+    
+    fnd::vector<std::unique_ptr<worker_state>> ws;
+    for(unsigned w = 0; w < nthreads; ++w)
+        ws.emplace_back(new worker_state());
+    
+    std::atomic<bool> abort(false);
+    auto cancel = [&] {
+        abort = true;
+        for(auto &st : ws)
+        {
+            std::lock_guard<std::mutex> lock(st->m);
+            st->cv.notify_all();
+        }
+    };
+    
+    fnd::vector<fnd::exception_ptr> errors(nthreads);
+    fnd::vector<std::thread> threads;
+    
+    auto run = [&] (const unsigned w) {
+        try {
+            with_device(rndmode, [&] (auto &rnd) {
+                auto work = make_work(rnd);
+                worker_state &st = *ws[w];
+                
+                uint64_t k = 0;
+                for(uint64_t j = w; j < nchunks; j += nthreads, ++k)
+                {
+                    slot &sl = st.slots[k % 2];
+                    {
+                        std::unique_lock<std::mutex> lock(st.m);
+                        st.cv.wait(lock, [&] { return !sl.full || abort; });
+                        if(abort)
+                            return;
+                    }
+                    
+                    const uint64_t first = j * chunk;
+                    const uint64_t last =
+                        total - first < chunk ? total : first + chunk;
+                    sl.buf.clear();
+                    work(first, last, sl.buf);
+                    
+                    {
+                        std::lock_guard<std::mutex> lock(st.m);
+                        sl.full = true;
+                    }
+                    st.cv.notify_all();
+                }
+            });
+        }
+        catch(...) {
+            errors[w] = fnd::current_exception();
+            cancel();
+        }
+    };
+    
+    try {
+        for(unsigned w = 0; w < nthreads; ++w)
+            threads.emplace_back(run, w);
+        
+        for(uint64_t j = 0; j < nchunks && !abort; ++j)
+        {
+            worker_state &st = *ws[j % nthreads];
+            slot &sl = st.slots[(j / nthreads) % 2];
+            {
+                std::unique_lock<std::mutex> lock(st.m);
+                st.cv.wait(lock, [&] { return sl.full || abort; });
+                if(abort)
+                    break;
+            }
+            
+            out.write(sl.buf.data(), sl.buf.size());
+            
+            {
+                std::lock_guard<std::mutex> lock(st.m);
+                sl.full = false;
+            }
+            st.cv.notify_all();
+        }
+    }
+    catch(...) {
+        cancel();
+        for(auto &t : threads)
+            t.join();
+        throw;
+    }
+    
+    for(auto &t : threads)
+        t.join();
+    for(auto &x : errors)
+        if(x)
+            std::rethrow_exception(x);
+}
+
+#endif // RSTR_WORKER_H
@@ -0,0 +1,109 @@
+#!/usr/bin/env perl
+# This file is part of 'rstr', a simple random string generator written in C++.
+#
+# Writes code/rstr/unicode_table.inc, the Unicode properties used by the
+# (class ...), (script ...) and (exclude ...) configs, from the Unicode
+# database shipped with Perl:
+#
+#   perl tools/unicode_table.pl > code/rstr/unicode_table.inc
+#
+# The codespace is cut into runs of equal General_Category and Script. Each
+# run is stored as its first code point with the category in the bits above
+# it, plus a byte for the script. Names are sorted by their loose form
+# (lower case without ' ', '-' and '_') for binary search.
+use strict;
+use warnings;
+use Unicode::UCD qw(prop_invmap prop_values prop_value_aliases);
+
+sub loose { my $s = lc shift; $s =~ s/[ _-]//g; return $s; }
+
+my ($gc_list, $gc_map) = prop_invmap('General_Category');
+my ($sc_list, $sc_map) = prop_invmap('Script');
+
+# Categories, Cn first so that it is 0.
+my @cats = ('Cn', grep { 2 == length && $_ ne 'Cn' && $_ ne 'LC' }
+    sort(prop_values('gc')));
+my %cat_id = map { $cats[$_] => $_ } 0 .. $#cats;
+die "Too many categories.\n" if @cats > 32;
+
+# Scripts, Unknown (Zzzz) first so that it is 0.
+my @scripts = ('Unknown', grep { $_ ne 'Unknown' }
+    sort(map { (prop_value_aliases('sc', $_))[1] } prop_values('sc')));
+my %script_id = map { $scripts[$_] => $_ } 0 .. $#scripts;
+die "Too many scripts.\n" if @scripts > 256;
+
+# Merge both inversion maps into runs.
+my @runs;
+{
+    my ($i, $j) = (0, 0);
+    my $cp = 0;
+    while($cp < 0x110000)
+    {
+        $i++ while $i + 1 < @$gc_list && $gc_list->[$i + 1] <= $cp;
+        $j++ while $j + 1 < @$sc_list && $sc_list->[$j + 1] <= $cp;
+        my $c = $cat_id{$gc_map->[$i]};
+        my $s = $script_id{(prop_value_aliases('sc', $sc_map->[$j]))[1]};
+        die "Unknown value at $cp.\n" unless defined $c && defined $s;
+        push @runs, [$cp, $c, $s]
+            unless @runs && $runs[-1][1] == $c && $runs[-1][2] == $s;
+        my $next = 0x110000;
+        $next = $gc_list->[$i + 1]
+            if $i + 1 < @$gc_list && $gc_list->[$i + 1] < $next;
+        $next = $sc_list->[$j + 1]
+            if $j + 1 < @$sc_list && $sc_list->[$j + 1] < $next;
+        $cp = $next;
+    }
+}
+
+# Category names and groups, e.g. Lu, Uppercase_Letter, L, Letter.
+my %class_names;
+for my $v (prop_values('gc'))
+{
+    my $mask = 0;
+    if(2 == length $v && $v ne 'LC') {
+        $mask = 1 << $cat_id{$v};
+    } else {
+        my @members = $v eq 'LC' ? qw(Lu Ll Lt)
+            : grep { substr($_, 0, 1) eq $v } keys %cat_id;
+        $mask |= 1 << $cat_id{$_} for @members;
+    }
+    $class_names{loose($_)} = $mask for prop_value_aliases('gc', $v);
+}
+
+my %script_names;
+for my $id (0 .. $#scripts)
+{
+    $script_names{loose($_)} = $id
+        for prop_value_aliases('sc', $scripts[$id]);
+}
+
+print "// Generated by tools/unicode_table.pl from Unicode ",
+    Unicode::UCD::UnicodeVersion(), ", do not edit.\n\n";
+
+print "const unicode_name unicode_class_names[] = {\n";
+printf "    {\"%s\", 0x%08X},\n", $_, $class_names{$_}
+    for sort keys %class_names;
+print "};\n\n";
+
+print "const unicode_name unicode_script_names[] = {\n";
+printf "    {\"%s\", %u},\n", $_, $script_names{$_}
+    for sort keys %script_names;
+print "};\n\n";
+
+print "// First code point | category << 21\n";
+print "const uint32_t unicode_runs[] = {\n";
+for(my $k = 0; $k < @runs; $k += 6)
+{
+    my @row = @runs[$k .. ($k + 5 < $#runs ? $k + 5 : $#runs)];
+    print "    ", join(", ",
+        map { sprintf "0x%07X", $_->[0] | $_->[1] << 21 } @row), ",\n";
+}
+print "};\n\n";
+
+print "const uint8_t unicode_run_scripts[] = {\n";
+for(my $k = 0; $k < @runs; $k += 16)
+{
+    my @row = @runs[$k .. ($k + 15 < $#runs ? $k + 15 : $#runs)];
+    print "    ", join(", ", map { $_->[2] } @row), ",\n";
+}
+print "};\n";